@@ -0,0 +1,31 @@
+#!/bin/sh
+# Compares checking many small files with one process per file against a
+# single driver run over a response file.
+#
+# usage: bench/build.sh [compiler] [files] [jobs]
+
+compiler=${1:-src/compiler}
+files=${2:-2000}
+jobs=${3:-$(nproc)}
+dir=$(dirname "$0")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+i=0
+while [ "$i" -lt "$files" ]; do
+  "$dir/gen.sh" $((i % 50 + 10)) > "$work/unit$i.cp"
+  echo "$work/unit$i.cp" >> "$work/list"
+  i=$((i + 1))
+done
+echo "== $files files, $(cat "$work"/*.cp | wc -c) bytes"
+
+now() { date +%s.%N; }
+since() { awk -v a="$1" -v b="$(now)" 'BEGIN { printf("%.3f", b - a) }'; }
+
+start=$(now)
+while read -r f; do "$compiler" "$f" -astdump > /dev/null; done < "$work/list"
+echo "one process per file: $(since "$start")s"
+
+start=$(now)
+"$compiler" "@$work/list" -jobs="$jobs" -time 2>&1 | tail -n 1
+echo "driver, $jobs jobs: $(since "$start")s"
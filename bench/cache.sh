@@ -0,0 +1,31 @@
+#!/bin/sh
+# Compares a build with an empty AST cache against one where every entry
+# hits, for many small files and for one large file. Some of the small files
+# call functions defined after main.
+#
+# usage: bench/cache.sh [compiler] [files] [blocks of the large file]
+
+compiler=${1:-src/compiler}
+files=${2:-2000}
+blocks=${3:-200000}
+dir=$(dirname "$0")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+i=0
+while [ "$i" -lt "$files" ]; do
+  "$dir/gen.sh" $((i % 50 + 10)) 2 $((i % 4)) > "$work/unit$i.cp"
+  echo "$work/unit$i.cp" >> "$work/list"
+  i=$((i + 1))
+done
+"$dir/gen.sh" "$blocks" > "$work/large.cp"
+echo "$work/large.cp" > "$work/large"
+
+for set in list large; do
+  echo "== $set: $(cat $(cat "$work/$set") | wc -c) bytes"
+  rm -rf "$work/cache"
+  for run in cold warm; do
+    "$compiler" "@$work/$set" -cache="$work/cache" -time 2>&1 | tail -n 1 |
+      sed "s/^/$run: /"
+  done
+done
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Compares threaded dispatch in the VM against the switch loop, both built
+# from src/ in a scratch directory, on calls that mostly store locals. Shows
+# time per op, and instructions per op when perf can count them.
+#
+# usage: bench/dispatch.sh [depth] [locals]
+
+depth=${1:-18}
+locals=${2:-20}
+dir=$(dirname "$0")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+for mode in threaded switch; do
+  mkdir "$work/$mode"
+  cp "$dir"/../src/*.c "$dir"/../src/*.h "$dir"/../src/Makefile "$work/$mode"
+  make -s -C "$work/$mode" VM_DISPATCH="$mode" > /dev/null 2>&1 || exit 1
+done
+
+# `depth` functions that each store `locals` variables and call the one
+# below twice. The idle program has the same functions and never calls them.
+gen() {
+  awk -v depth="$depth" -v locals="$locals" -v idle="$1" 'BEGIN {
+    for (i = 0; i < depth; i++) {
+      printf("f%d() {\n", i)
+      for (j = 0; j < locals; j++) printf("  i32 a%d = %d;\n", j, j)
+      if (i > 0) printf("  f%d();\n  f%d();\n", i - 1, i - 1)
+      printf("}\n")
+    }
+    if (idle) printf("main() {\n}\n")
+    else printf("main() {\n  f%d();\n}\n", depth - 1)
+  }'
+}
+gen 0 > "$work/calls.cp"
+gen 1 > "$work/idle.cp"
+
+instructions() {
+  perf stat -x, -e instructions "$@" 2>&1 > /dev/null |
+    awk -F, '/instructions/ { print $1 }'
+}
+
+ops=$("$work/threaded/compiler" -vmstats "$work/calls.cp" 2>&1 |
+      awk '$1 == "total" { print $2 }')
+echo "== depth $depth, $locals locals, $ops ops"
+
+for mode in threaded switch; do
+  compiler="$work/$mode/compiler"
+  best=
+  for run in 1 2 3; do
+    time=$("$compiler" -time "$work/calls.cp" 2>&1 |
+           awk '$1 == "run:" { sub("s", "", $2); print $2 }')
+    best=$(awk -v a="$best" -v b="$time" \
+               'BEGIN { print (a == "" || b < a) ? b : a }')
+  done
+  line=$(awk -v t="$best" -v n="$ops" \
+             'BEGIN { printf("%.3fs, %.2f ns/op", t, t * 1e9 / n) }')
+
+  if command -v perf > /dev/null 2>&1; then
+    busy=$(instructions "$compiler" "$work/calls.cp")
+    idle=$(instructions "$compiler" "$work/idle.cp")
+    if [ -n "$busy" ] && [ -n "$idle" ]; then
+      line="$line, $(awk -v a="$busy" -v b="$idle" -v n="$ops" \
+                         'BEGIN { printf("%.1f", (a - b) / n) }') insns/op"
+    fi
+  fi
+  echo "$mode: $line"
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Generates a large, comment heavy .cp source on stdout, similar in shape to
+# the generated sources we feed the compiler.
+#
+# usage: bench/gen.sh [blocks] [comment lines per block] [functions]
+#
+# The functions are called at the start of main and defined after it.
+
+blocks=${1:-20000}
+comment_lines=${2:-2}
+functions=${3:-0}
+
+awk -v blocks="$blocks" -v comment_lines="$comment_lines" \
+    -v functions="$functions" 'BEGIN {
+  print "// Generated benchmark input"
+  print "main() {"
+  for (i = 0; i < functions; i++)
+    printf("  function_%d();\n", i)
+  for (i = 0; i < blocks; i++) {
+    printf("  /* block %d: this comment is here to look like the generated", i)
+    for (j = 1; j < comment_lines; j++)
+      printf("\n     documentation that precedes every table entry.")
+    printf(" */\n")
+    printf("  i32 value_%d = %d; // value for entry %d\n", i,
+           i * 7919 % 1000003, i)
+    printf("  {\n")
+    printf("    printf(\"entry %d has a fairly long format string\\n\");\n", i)
+    printf("  }\n")
+  }
+  print "}"
+  for (i = 0; i < functions; i++)
+    printf("function_%d() {\n  printf(\"function %d\\n\");\n}\n", i, i)
+}'
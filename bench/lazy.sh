@@ -0,0 +1,32 @@
+#!/bin/sh
+# Runs a large script library where main only calls a few functions, with
+# every body parsed up front and with bodies parsed on first call.
+#
+# usage: bench/lazy.sh [compiler] [functions] [statements per function]
+
+compiler=${1:-src/compiler}
+functions=${2:-20000}
+statements=${3:-40}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+awk -v functions="$functions" -v statements="$statements" 'BEGIN {
+  for (i = 0; i < functions; i++) {
+    printf("helper_%d() {\n", i)
+    for (j = 0; j < statements; j++) {
+      printf("  i32 local_%d = %d;\n", j, i * j)
+      printf("  { printf(\"helper %d step %d\\n\"); }\n", i, j)
+    }
+    printf("}\n")
+  }
+  print "main() {"
+  for (i = 0; i < functions; i += int(functions / 4))
+    printf("  helper_%d();\n", i)
+  print "}"
+}' > "$work/lib.cp"
+echo "== $functions functions, $(wc -c < "$work/lib.cp") bytes"
+
+for flags in "" "-lazy" "-prelex" "-prelex -lazy"; do
+  echo "-- ${flags:-eager}"
+  "$compiler" "$work/lib.cp" -time $flags 2>&1 > /dev/null
+done
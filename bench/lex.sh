@@ -0,0 +1,18 @@
+#!/bin/sh
+# Compares lexer throughput of every scanner the CPU supports on generated
+# input with light and heavy commenting.
+#
+# usage: bench/lex.sh [compiler]
+
+compiler=${1:-src/compiler}
+dir=$(dirname "$0")
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+
+for comment_lines in 2 20; do
+  "$dir/gen.sh" 100000 "$comment_lines" > "$input"
+  echo "== $comment_lines comment lines per block, $(wc -c < "$input") bytes"
+  for s in scalar sse2 avx2; do
+    "$compiler" "$input" -lexbench -scan=$s
+  done
+done
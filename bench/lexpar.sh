@@ -0,0 +1,18 @@
+#!/bin/sh
+# Measures how token stream lexing scales with the number of lexer threads.
+#
+# usage: bench/lexpar.sh [compiler] [max threads]
+
+compiler=${1:-src/compiler}
+max=${2:-$(nproc)}
+dir=$(dirname "$0")
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+
+"$dir/gen.sh" 400000 > "$input"
+echo "== $(wc -c < "$input") bytes"
+threads=1
+while [ "$threads" -le "$max" ]; do
+  "$compiler" "$input" -lexbench -lexthreads=$threads
+  threads=$((threads * 2))
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Runs generated code that repeats a handful of format strings and constants,
+# and reports the parse time and the size of its AST, as written to the
+# cache.
+#
+# usage: bench/literals.sh [compiler] [functions] [statements per function]
+
+compiler=${1:-src/compiler}
+functions=${2:-20000}
+statements=${3:-40}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+awk -v functions="$functions" -v statements="$statements" 'BEGIN {
+  for (i = 0; i < functions; i++) {
+    printf("gen_%d() {\n", i)
+    for (j = 0; j < statements; j++) {
+      printf("  i32 v_%d = %d;\n", j, j % 8)
+      printf("  printf(\"generated step, value %%d\\n\", %d);\n", j % 8)
+    }
+    printf("}\n")
+  }
+  print "main() {"
+  print "  gen_0();"
+  print "}"
+}' > "$work/gen.cp"
+echo "== $functions functions, $(wc -c < "$work/gen.cp") bytes"
+
+for flags in "" "-prelex"; do
+  echo "-- ${flags:-lex+parse}"
+  "$compiler" "$work/gen.cp" -time -cache="$work/cache" $flags 2>&1 > /dev/null
+  echo "ast: $(cat "$work/cache"/*.ast | wc -c) bytes"
+  rm -rf "$work/cache"
+done
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Parses pathologically nested inputs: scopes, call arguments and declaration
+# values nested `depth` levels deep, for growing depths.
+#
+# usage: bench/nest.sh [compiler] [max depth]
+
+compiler=${1:-src/compiler}
+max=${2:-1000000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gen() {
+  awk -v shape="$1" -v depth="$2" 'BEGIN {
+    printf("main() {\n")
+    if (shape == "scope") {
+      for (i = 0; i < depth; i++) printf("{")
+      printf("printf(\"x\");")
+      for (i = 0; i < depth; i++) printf("}")
+    } else if (shape == "call") {
+      for (i = 0; i < depth; i++) printf("printf(")
+      printf("\"x\"")
+      for (i = 0; i < depth; i++) printf(");")
+    } else {
+      for (i = 0; i < depth; i++) printf("i32 v = ")
+      printf("1")
+      for (i = 0; i < depth; i++) printf(";")
+    }
+    printf("\n}\n")
+  }'
+}
+
+depth=1000
+while [ "$depth" -le "$max" ]; do
+  for shape in scope call decl; do
+    gen "$shape" "$depth" > "$work/$shape.cp"
+    echo "$work/$shape.cp" > "$work/list"
+    out=$("$compiler" "@$work/list" -time 2>&1)
+    status=$?
+    if [ "$status" -gt 128 ]; then
+      result="crashed (signal $((status - 128)))"
+    else
+      result=$(echo "$out" | grep "$shape.cp:" | sed 's/.*: //')
+    fi
+    printf "%-5s depth %-8d %s\n" "$shape" "$depth" "$result"
+  done
+  depth=$((depth * 10))
+done
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Compares output buffer sizes on a program that prints `2^depth` lines into
+# a pipe, from a write per line to the default and larger.
+#
+# usage: bench/output.sh [compiler] [depth]
+
+compiler=${1:-src/compiler}
+depth=${2:-21}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+awk -v depth="$depth" 'BEGIN {
+  printf("f0() {\n  printf(\"a line of log output\\n\");\n}\n")
+  for (i = 1; i < depth; i++) {
+    printf("f%d() {\n  f%d();\n", i, i - 1)
+    printf("  printf(\"a line of log output\\n\");\n  f%d();\n}\n", i - 1)
+  }
+  printf("main() {\n  f%d();\n}\n", depth - 1)
+}' > "$work/log.cp"
+
+echo "== $(( (1 << depth) - 1 )) lines"
+for size in 0 4096 65536 1048576; do
+  time=$( { "$compiler" -outbuf="$size" -time "$work/log.cp" |
+            cat > /dev/null; } 2>&1 | awk '$1 == "run:" { print $2 }')
+  echo "$size byte buffer: $time"
+done
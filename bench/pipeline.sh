@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs a long generated script of top level definitions and calls, parsed
+# whole before running and pipelined. Reports the time to the first output
+# and the total time.
+#
+# usage: bench/pipeline.sh [compiler] [items]
+
+compiler=${1:-src/compiler}
+items=${2:-200000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+awk -v items="$items" 'BEGIN {
+  for (i = 0; i < items; i++) {
+    printf("step_%d() {\n  i32 value = %d;\n", i, i)
+    printf("  { printf(\"step %d of the generated script\\n\"); }\n}\n", i)
+    printf("step_%d();\n", i)
+  }
+  print "main() { step_0(); }"
+}' > "$work/script.cp"
+echo "== $items items, $(wc -c < "$work/script.cp") bytes"
+
+now() { date +%s.%N; }
+since() { awk -v a="$1" -v b="$(now)" 'BEGIN { printf("%.3f", b - a) }'; }
+
+for flags in "" "-pipeline" "-prelex" "-prelex -pipeline"; do
+  start=$(now)
+  "$compiler" "$work/script.cp" $flags | head -c 1 > /dev/null
+  first=$(since "$start")
+  start=$(now)
+  "$compiler" "$work/script.cp" $flags > /dev/null
+  echo "${flags:-batch}: first output $first s, total $(since "$start") s"
+done
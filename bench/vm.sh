@@ -0,0 +1,36 @@
+#!/bin/sh
+# Compares running call heavy programs on the bytecode VM against walking the
+# AST: `depth` functions that each call the one below twice and print, so
+# every body runs many times, and a script of top level statements that each
+# run once.
+#
+# usage: bench/vm.sh [compiler] [depth] [lines]
+
+compiler=${1:-src/compiler}
+depth=${2:-18}
+lines=${3:-200000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+awk -v depth="$depth" 'BEGIN {
+  printf("f0() {\n  i32 a = 0;\n  printf(\"%%d\\n\", 0);\n}\n")
+  for (i = 1; i < depth; i++) {
+    printf("f%d() {\n  i32 a = %d;\n  f%d();\n", i, i, i - 1)
+    printf("  printf(\"%%d %%s\\n\", %d, \"x\");\n  f%d();\n}\n", i, i - 1)
+  }
+  printf("main() {\n  f%d();\n}\n", depth - 1)
+}' > "$work/calls.cp"
+
+awk -v lines="$lines" 'BEGIN {
+  for (i = 0; i < lines; i++) printf("printf(\"line %%d\\n\", %d);\n", i)
+  printf("main() {\n}\n")
+}' > "$work/script.cp"
+
+for input in calls script; do
+  echo "== $input.cp, $(wc -c < "$work/$input.cp") bytes"
+  for engine in walk vm; do
+    time=$("$compiler" -engine="$engine" -time "$work/$input.cp" 2>&1 \
+           > /dev/null | grep "^run:" | sed 's/run: *//')
+    echo "$engine: $time"
+  done
+done
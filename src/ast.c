@@ -1,11 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "ast.h"
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
-#include "arena.h"
+#include "stb_ds.h"
 
 static bool _parser_expect(parser_t *p, token_t t);
 
@@ -13,201 +17,822 @@ static bool _parser_expect_next(parser_t *p, token_t t);
 
 static void _throw_expect_but_got(parser_t *p, token_t t1, token_t t2);
 
-static Arena ast_arena = {0};
+static void _parser_advance(parser_t *p);
 
-void parser_init(parser_t *p, lex_t *lexer) {
+static void _parser_diag(parser_t *p, const char *msg);
+static void _throw_error(parser_t *p, const char *msg);
+
+static ast_ref_t _parser_node(parser_t *p);
+
+static ast_ref_t _parser_open(parser_t *p);
+
+static bool _parser_reduce(parser_t *p, ast_ref_t *ref);
+
+static ast_ref_t _parser_close_scope(parser_t *p, const parser_frame_t *f);
+
+static void _ast_init(ast_t *ast) {
+  *ast = (ast_t){0};
+  arrput(ast->nodes, 0);  // AST_NIL
+  ast->nodes_len = 1;
+}
+
+static void _parser_setup(parser_t *p, lex_t *lexer) {
   p->lexer = lexer;
+  _ast_init(&p->ast);
+  p->scratch = NULL;
+  p->frames = NULL;
+  p->diag_arena = (Arena){0};
+  p->diags = p->diags_last = NULL;
+  p->error_count = 0;
+  p->input_failed = false;
+  p->recover = NULL;
+  p->lazy = false;
+  p->consts = NULL;
+  p->consts_capacity = 0;
+  p->consts_count = 0;
+}
+
+void parser_init(parser_t *p, lex_t *lexer) {
+  _parser_setup(p, lexer);
   p->current_token = lex_next(lexer);
 }
 
-ast_node_t *parser_next(parser_t *p) {
-  assert(A_LAST == 7 && "Implementation missing");
+void parser_init_stream(parser_t *p, lex_t *lexer, lex_stream_t *ts) {
+  _parser_setup(p, lexer);
+  p->stream = ts;
+  p->stream_pos = 0;
+  p->current_token = lex_kind_unpack(ts->kinds[0]);
+}
 
-  if (!p || p->current_token == T_EOF) return NULL;
+static void _parser_advance(parser_t *p) {
+  if (p->stream) {
+    if (p->stream_pos + 1 < p->stream->count) p->stream_pos++;
+    p->current_token = lex_kind_unpack(p->stream->kinds[p->stream_pos]);
+  } else {
+    p->current_token = lex_next(p->lexer);
+  }
+}
 
-  ast_node_t *node = arena_alloc(&ast_arena, sizeof(ast_node_t));
+static inline sym_t _parser_sym(parser_t *p) {
+  if (p->stream) return p->stream->values[p->stream_pos];
+  return p->lexer->tok.sym;
+}
 
-  // String literal
-  if (p->current_token == T_STRLIT) {
-    node->kind = A_STRLIT;
+static inline uint32_t _parser_offset(parser_t *p) {
+  if (p->stream) return p->stream->starts[p->stream_pos];
+  return p->lexer->tok.start;
+}
+
+static inline uint32_t _parser_len(parser_t *p) {
+  if (p->stream) return p->stream->lens[p->stream_pos];
+  return p->lexer->tok.len;
+}
+
+static inline long _parser_int(parser_t *p) {
+  if (p->stream) return p->stream->values[p->stream_pos];
+  return p->lexer->tok.int_val;
+}
+
+// Appends the current string literal to the string pool, decoding it straight
+// from the input when parsing a token stream. Returns its offset in the pool
+// and its length in `len`.
+static uint32_t _parser_str(parser_t *p, uint32_t *len) {
+  ast_t *ast = &p->ast;
+  size_t at = arrlenu(ast->strings), n;
+
+  if (p->stream) {
+    lex_stream_t *ts = p->stream;
+    size_t raw_len = ts->values[p->stream_pos];
+    char *str = arraddnptr(ast->strings, raw_len + 1);
+    n = lex_unescape(lex_at(p->lexer, ts->starts[p->stream_pos] + 1), raw_len,
+                     str);
+  } else {
+    lex_token_t *tok = &p->lexer->tok;
+    char *str = arraddnptr(ast->strings, tok->str_val_size + 1);
+    memcpy(str, tok->str_val, tok->str_val_size);
+    n = tok->str_val_size;
+  }
+
+  arrsetlen(ast->strings, at + n + 1);
+  ast->strings[at + n] = '\0';
+  *len = n;
+  return at;
+}
+
+// Checks that the current integer literal fits an i32. Hexadecimal and binary
+// literals may use all 32 bits and are read as two's complement.
+static bool _parser_i32(parser_t *p, int32_t *value) {
+  long v = _parser_int(p);
+
+  if (v == LEX_INT_INVALID) {
+    _throw_error(p, "Invalid integer literal");
+    return false;
+  }
+
+  const char *text = lex_at(p->lexer, _parser_offset(p));
+  bool radix = _parser_len(p) > 1 && text[0] == '0' &&
+               ((text[1] | 0x20) == 'x' || (text[1] | 0x20) == 'b');
+  if (v == LEX_INT_OVERFLOW || v > (radix ? (long)UINT32_MAX : INT32_MAX)) {
+    _throw_error(p, "Integer literal out of range for i32");
+    return false;
+  }
+
+  *value = (int32_t)(uint32_t)v;
+  return true;
+}
+
+// Makes the lexer describe the current token in diagnostics.
+static void _parser_sync_lexer(parser_t *p) {
+  if (p->stream) lex_stream_load(p->stream, p->stream_pos, p->lexer);
+}
+
+// Brings the counts of the AST up to date.
+static void _parser_update_counts(parser_t *p) {
+  ast_t *ast = &p->ast;
+  ast->nodes_len = arrlenu(ast->nodes);
+  ast->strings_len = arrlenu(ast->strings);
+  ast->root_count = arrlenu(ast->roots);
+}
+
+// Bodies can only be skipped when their text is still there to parse later.
+static bool _parser_lazy(parser_t *p) {
+  return p->lazy &&
+         (p->stream || (p->lexer->fd < 0 && p->lexer->base == 0));
+}
+
+// Skips a function body, from its '{' to the matching '}'.
+static void _parser_skip_body(parser_t *p) {
+  size_t depth = 0;
+  do {
+    if (p->current_token == '{') {
+      depth++;
+    } else if (p->current_token == '}') {
+      depth--;
+    } else if (p->current_token == T_EOF) {
+      _throw_expect_but_got(p, '}', T_EOF);
+      return;
+    }
+    _parser_advance(p);
+  } while (depth > 0);
+}
+
+// Adds a node made of the `head` words followed by the children pushed to
+// the scratch stack since `mark`, which are popped.
+static ast_ref_t _parser_emit(parser_t *p, const uint32_t *head,
+                              size_t head_len, size_t mark) {
+  ast_t *ast = &p->ast;
+  size_t count = arrlenu(p->scratch) - mark;
+  ast_ref_t ref = arrlenu(ast->nodes);
+
+  uint32_t *w = arraddnptr(ast->nodes, head_len + count);
+  memcpy(w, head, head_len * sizeof(*w));
+  if (count) memcpy(w + head_len, p->scratch + mark, count * sizeof(*w));
+  arrsetlen(p->scratch, mark);
+
+  ast->node_count++;
+  return ref;
+}
+
+// Hash of a literal given as its words.
+static uint32_t _ast_const_hash(const ast_t *ast, const uint32_t *n) {
+  if (n[0] == A_STRLIT) return intern_hash(ast->strings + n[1], n[2]);
+  return (n[1] ^ n[0]) * 0x9e3779b1u;
+}
+
+static bool _ast_const_equal(const ast_t *ast, ast_ref_t ref,
+                             const uint32_t *n) {
+  const uint32_t *x = ast->nodes + ref;
+  if (x[0] != n[0]) return false;
+  if (n[0] == A_STRLIT)
+    return x[2] == n[2] &&
+           memcmp(ast->strings + x[1], ast->strings + n[1], n[2]) == 0;
+  return x[1] == n[1];
+}
+
+static void _parser_grow_consts(parser_t *p) {
+  size_t capacity = p->consts_capacity ? p->consts_capacity * 2 : 256;
+  parser_const_t *grown = calloc(capacity, sizeof(*grown));
+  assert(grown && "Out of memory");
+
+  for (size_t i = 0; i < p->consts_capacity; ++i) {
+    if (p->consts[i].ref == AST_NIL) continue;
+    size_t at = p->consts[i].hash & (capacity - 1);
+    while (grown[at].ref) at = (at + 1) & (capacity - 1);
+    grown[at] = p->consts[i];
+  }
+
+  free(p->consts);
+  p->consts = grown;
+  p->consts_capacity = capacity;
+}
+
+// Adds the literal made of the words `node` unless an equal one exists, and
+// returns the node to use. The text of a string literal already in the pool
+// is dropped again.
+static ast_ref_t _parser_const(parser_t *p, const uint32_t *node) {
+  if ((p->consts_count + 1) * 2 > p->consts_capacity) _parser_grow_consts(p);
+
+  size_t mask = p->consts_capacity - 1;
+  uint32_t hash = _ast_const_hash(&p->ast, node);
+  size_t at = hash & mask;
+  for (; p->consts[at].ref; at = (at + 1) & mask) {
+    ast_ref_t ref = p->consts[at].ref;
+    if (p->consts[at].hash != hash || !_ast_const_equal(&p->ast, ref, node))
+      continue;
+    if (node[0] == A_STRLIT) arrsetlen(p->ast.strings, node[1]);
+    return ref;
+  }
 
-    node->data.str_val = arena_alloc(&ast_arena, p->lexer->str_val_size + 1);
-    strncpy(node->data.str_val, p->lexer->str_val, p->lexer->str_val_size);
-    node->data.str_val[p->lexer->str_val_size] = '\0';
+  size_t len = node[0] == A_STRLIT ? 3 : 2;
+  ast_ref_t ref = _parser_emit(p, node, len, arrlenu(p->scratch));
+  p->consts[at] = (parser_const_t){ref, hash};
+  p->consts_count++;
+  return ref;
+}
 
+// Drops the statement a syntax error is in and skips past its ';', or up to
+// the '}' of the scope it is in. Outside of a scope, the whole item is
+// dropped. Nodes already added stay in the AST, unreachable.
+static void _parser_resync(parser_t *p) {
+  size_t scope = arrlenu(p->frames);
+  while (scope > 0 && p->frames[scope - 1].kind != A_SCOPE) scope--;
+
+  if (scope < arrlenu(p->frames)) arrsetlen(p->scratch, p->frames[scope].mark);
+  arrsetlen(p->frames, scope);
+
+  size_t depth = 0;
+  for (; p->current_token != T_EOF; _parser_advance(p)) {
+    if (p->current_token == '{') {
+      depth++;
+    } else if (p->current_token == '}' && depth > 0) {
+      depth--;
+    } else if (p->current_token == '}' || p->current_token == ';') {
+      if (depth > 0) continue;
+      // The '}' closes the scope, see _parser_node().
+      if (p->current_token == ';' || scope == 0) _parser_advance(p);
+      break;
+    }
+  }
+
+  if (p->current_token == T_EOF) {
+    size_t none = 0;
+    arrsetlen(p->frames, none);
+    arrsetlen(p->scratch, none);
+  }
+}
+
+ast_ref_t parser_next(parser_t *p) {
+  if (!p) return AST_NIL;
+
+  jmp_buf recover;
+  p->recover = &recover;
+  if (setjmp(recover)) _parser_resync(p);
+
+  ast_ref_t ref = AST_NIL;
+  if (p->current_token != T_EOF) {
+    ref = _parser_node(p);
+    arrput(p->ast.roots, ref);
+  } else if (p->lexer->error[0] && !p->input_failed) {
+    // The lexer stopped short of the end, so the input is incomplete.
+    _parser_diag(p, p->lexer->error);
+    p->input_failed = true;
+  }
+
+  p->recover = NULL;
+  _parser_update_counts(p);
+  return ref;
+}
+
+void parser_reset_ast(parser_t *p) {
+  size_t none = 0;
+  ast_t *ast = &p->ast;
+  arrsetlen(ast->nodes, 1);  // AST_NIL
+  arrsetlen(ast->strings, none);
+  ast->node_count = 0;
+  arrsetlen(ast->roots, none);
+  if (p->consts_count) {
+    memset(p->consts, 0, p->consts_capacity * sizeof(*p->consts));
+    p->consts_count = 0;
+  }
+  _parser_update_counts(p);
+}
+
+ast_ref_t parser_body(parser_t *p, ast_ref_t fn) {
+  ast_t *ast = &p->ast;
+  if (ast_body(ast, fn) != AST_NIL) return ast_body(ast, fn);
+
+  // Go back to the definition, parse the body after `name ( )` and return
+  // to the end of the input.
+  uint32_t offset = ast_offset(ast, fn);
+  size_t end = p->stream_pos;
+
+  if (p->stream) {
+    size_t lo = 0, hi = p->stream->count - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (p->stream->starts[mid] < offset) lo = mid + 1;
+      else hi = mid;
+    }
+    p->stream_pos = lo;
+    p->current_token = lex_kind_unpack(p->stream->kinds[lo]);
+  } else {
+    lex_seek(p->lexer, offset);
     p->current_token = lex_next(p->lexer);
+  }
+
+  jmp_buf recover;
+  ast_ref_t body = AST_NIL;
+  p->recover = &recover;
+  if (setjmp(recover) == 0) {
+    _parser_advance(p);
+    _parser_advance(p);
+    _parser_advance(p);
+    body = _parser_node(p);
+  } else {
+    size_t none = 0;
+    arrsetlen(p->frames, none);
+    arrsetlen(p->scratch, none);
+    body = AST_NIL;
+  }
+  p->recover = NULL;
+
+  if (p->stream) {
+    p->stream_pos = end;
+    p->current_token = lex_kind_unpack(p->stream->kinds[end]);
+  } else {
+    lex_seek(p->lexer, p->lexer->base + p->lexer->src_len);
+    p->current_token = lex_next(p->lexer);
+  }
+
+  ast->nodes[fn + 3] = body;
+  _parser_update_counts(p);
+  return body;
+}
+
+// Parses one node with all its children. Nodes with children are opened on
+// the frame stack and closed once their last child is parsed, so deep input
+// does not recurse.
+static ast_ref_t _parser_node(parser_t *p) {
+  for (;;) {
+    size_t depth = arrlenu(p->frames);
+    ast_ref_t ref;
+
+    if (depth > 0 && p->current_token == '}' &&
+        arrlast(p->frames).kind == A_SCOPE) {
+      // A scope whose last statement was dropped by _parser_resync().
+      parser_frame_t f = arrpop(p->frames);
+      ref = _parser_close_scope(p, &f);
+    } else {
+      ref = _parser_open(p);
+      if (arrlenu(p->frames) > depth) continue;
+    }
+
+    // `ref` is complete: hand it to the enclosing nodes, closing the ones it
+    // completes in turn.
+    for (;;) {
+      if (arrlenu(p->frames) == 0) return ref;
+      if (!_parser_reduce(p, &ref)) break;
+    }
+  }
+}
+
+static ast_ref_t _parser_close_scope(parser_t *p, const parser_frame_t *f) {
+  _parser_advance(p);
+
+  uint32_t count = arrlenu(p->scratch) - f->mark;
+  uint32_t head[3] = {AST_HEADER(A_SCOPE, 0), f->offset, count};
+  return _parser_emit(p, head, 3, f->mark);
+}
+
+static uint32_t _parser_argc(parser_t *p, const parser_frame_t *f) {
+  uint32_t argc = arrlenu(p->scratch) - f->mark;
+  if (argc > AST_SMALL_MAX) _throw_error(p, "Too many arguments");
+  return argc;
+}
+
+static ast_ref_t _parser_close_call(parser_t *p, const parser_frame_t *f) {
+  if (!_parser_expect_next(p, ';')) return AST_NIL;
+
+  _parser_advance(p);
+
+  uint32_t head[4] = {AST_HEADER(A_FUNCALL, _parser_argc(p, f)), f->offset,
+                      f->name, AST_NIL};
+  return _parser_emit(p, head, 4, f->mark);
+}
+
+// Adds a function with body `body`, which may be AST_NIL.
+static ast_ref_t _parser_close_function(parser_t *p, const parser_frame_t *f,
+                                        ast_ref_t body) {
+  uint32_t head[5] = {AST_HEADER(f->kind, _parser_argc(p, f)), f->offset,
+                      f->name, body, 0};
+  return _parser_emit(p, head, 5, f->mark);
+}
+
+static parser_frame_t _parser_frame(parser_t *p, ast_kind_t kind) {
+  return (parser_frame_t){.kind = kind,
+                          .offset = _parser_offset(p),
+                          .mark = arrlenu(p->scratch)};
+}
+
+// Parses a leaf, or the part of a node up to its first child and pushes a
+// frame for it.
+static ast_ref_t _parser_open(parser_t *p) {
+  assert(A_LAST == 7 && "Implementation missing");
 
-    return node;
+  if (p->current_token == T_EOF) return AST_NIL;
+
+  // String literal
+  if (p->current_token == T_STRLIT) {
+    uint32_t node[3] = {AST_HEADER(A_STRLIT, 0)};
+    node[1] = _parser_str(p, &node[2]);
+    ast_ref_t ref = _parser_const(p, node);
+
+    _parser_advance(p);
+
+    return ref;
   }
 
   // I32 literal
   if (p->current_token == T_INTLIT) {
-    node->kind = A_I32;
-    node->data.int_val = p->lexer->int_val;
-    p->current_token = lex_next(p->lexer);
-    return node;
+    int32_t value;
+    if (!_parser_i32(p, &value)) return AST_NIL;
+    uint32_t node[2] = {AST_HEADER(A_I32, 0), (uint32_t)value};
+    ast_ref_t ref = _parser_const(p, node);
+    _parser_advance(p);
+    return ref;
   }
 
   // Main function
-  if (p->current_token == T_SYMBOL &&
-      strncmp("main", p->lexer->str_val, 4) == 0) {
-    node->data.fundef.name =
-        arena_alloc(&ast_arena, p->lexer->str_val_size + 1);
-    strncpy(node->data.fundef.name, p->lexer->str_val, p->lexer->str_val_size);
-    node->data.fundef.name[p->lexer->str_val_size] = '\0';
+  if (p->current_token == T_SYMBOL && _parser_sym(p) == SYM_MAIN) {
+    parser_frame_t f = _parser_frame(p, A_MAIN);
+    f.name = SYM_MAIN;
 
-    if (!_parser_expect_next(p, '(')) return NULL;
-    if (!_parser_expect_next(p, ')')) return NULL;
+    if (!_parser_expect_next(p, '(')) return AST_NIL;
+    if (!_parser_expect_next(p, ')')) return AST_NIL;
 
-    p->current_token = lex_next(p->lexer);
+    _parser_advance(p);
 
-    node->kind = A_MAIN;
-    node->data.fundef.body = parser_next(p);
-    return node;
+    arrput(p->frames, f);
+    return AST_NIL;
+  }
+
+  // Function definition
+  else if (p->current_token == T_SYMBOL && parser_peek(p, 1) == '(' &&
+           parser_peek(p, 2) == ')' && parser_peek(p, 3) == '{') {
+    parser_frame_t f = _parser_frame(p, A_FUNDEF);
+    f.name = _parser_sym(p);
+
+    _parser_advance(p);
+    _parser_advance(p);
+    _parser_advance(p);
+
+    if (_parser_lazy(p)) {
+      _parser_skip_body(p);
+      return _parser_close_function(p, &f, AST_NIL);
+    }
+
+    arrput(p->frames, f);
+    return AST_NIL;
   }
 
   // Scope
   else if (p->current_token == '{') {
-    node->kind = A_SCOPE;
+    parser_frame_t f = _parser_frame(p, A_SCOPE);
 
-    p->current_token = lex_next(p->lexer);
-    while (p->current_token != '}') {
-      ast_node_t *arg = parser_next(p);
-      arena_da_append(&ast_arena, &node->data.statements, arg);
+    _parser_advance(p);
+    if (p->current_token == '}') return _parser_close_scope(p, &f);
+    if (p->current_token == T_EOF) {
+      _throw_expect_but_got(p, '}', T_EOF);
+      return AST_NIL;
     }
 
-    p->current_token = lex_next(p->lexer);
-
-    return node;
+    arrput(p->frames, f);
+    return AST_NIL;
   }
 
   // Variable declaration
   else if (p->current_token == T_I32) {
-    node->kind = A_VAR_DECLARE;
+    parser_frame_t f = _parser_frame(p, A_VAR_DECLARE);
 
-    if (p->current_token == T_I32) node->data.vardeclare.kind = A_I32;
+    if (p->current_token == T_I32) f.type = A_I32;
 
-    if (!_parser_expect_next(p, T_SYMBOL)) return NULL;
+    if (!_parser_expect_next(p, T_SYMBOL)) return AST_NIL;
 
-    node->data.vardeclare.name = arena_alloc(&ast_arena,
-        p->lexer->str_val_size + 1);
-    strncpy(node->data.vardeclare.name, p->lexer->str_val,
-        p->lexer->str_val_size);
-    node->data.vardeclare.name[p->lexer->str_val_size] = '\0';
+    f.name = _parser_sym(p);
 
-    if (!_parser_expect_next(p, '=')) return NULL;
-
-    p->current_token = lex_next(p->lexer);
-    node->data.vardeclare.value = parser_next(p);
+    if (!_parser_expect_next(p, '=')) return AST_NIL;
 
-    if (!_parser_expect(p, ';')) return NULL;
+    _parser_advance(p);
 
-    p->current_token = lex_next(p->lexer);
-
-    return node;
+    arrput(p->frames, f);
+    return AST_NIL;
   }
 
   // Function call
   else if (p->current_token == T_SYMBOL) {
-    node->kind = A_FUNCALL;
-    node->data.funcall.name =
-        arena_alloc(&ast_arena, p->lexer->str_val_size + 1);
-    strncpy(node->data.funcall.name, p->lexer->str_val, p->lexer->str_val_size);
-    node->data.funcall.name[p->lexer->str_val_size] = '\0';
+    parser_frame_t f = _parser_frame(p, A_FUNCALL);
+    f.name = _parser_sym(p);
 
-    if (!_parser_expect_next(p, '(')) return NULL;
+    if (!_parser_expect_next(p, '(')) return AST_NIL;
 
-    p->current_token = lex_next(p->lexer);
-    while (p->current_token != ')') {
-      arena_da_append(&ast_arena, &node->data.funcall.args, parser_next(p));
+    _parser_advance(p);
+    if (p->current_token == ')') return _parser_close_call(p, &f);
+    if (p->current_token == T_EOF) {
+      _throw_expect_but_got(p, ')', T_EOF);
+      return AST_NIL;
+    }
+
+    arrput(p->frames, f);
+    return AST_NIL;
+  }
 
+  char buf[LEX_MAX_SYMBOL_LEN], msg[sizeof(buf) + 32];
+  _parser_sync_lexer(p);
+  lex_kind_label(p->lexer, p->current_token, buf);
+  snprintf(msg, sizeof(msg), "Unexpected token %s", buf);
+  _throw_error(p, msg);
+
+  return AST_NIL;
+}
+
+// Gives the complete node `*ref` to the innermost open node. When that
+// completes it too, pops its frame, adds the node, stores it in `*ref` and
+// returns true.
+static bool _parser_reduce(parser_t *p, ast_ref_t *ref) {
+  assert(A_LAST == 7 && "Implementation missing");
+
+  parser_frame_t *f = &arrlast(p->frames);
+  ast_ref_t node = AST_NIL;
+
+  switch (f->kind) {
+    case A_MAIN:
+    case A_FUNDEF:
+      node = _parser_close_function(p, f, *ref);
+      break;
+
+    case A_SCOPE:
+      arrput(p->scratch, *ref);
+      if (p->current_token == T_EOF) {
+        _throw_expect_but_got(p, '}', T_EOF);
+        return false;
+      }
+      if (p->current_token != '}') return false;
+      node = _parser_close_scope(p, f);
+      break;
+
+    case A_VAR_DECLARE: {
+      if (!_parser_expect(p, ';')) return false;
+      _parser_advance(p);
+      uint32_t head[5] = {AST_HEADER(A_VAR_DECLARE, f->type), f->offset,
+                          f->name, *ref, AST_GLOBAL};
+      node = _parser_emit(p, head, 5, f->mark);
+    } break;
+
+    case A_FUNCALL:
+      arrput(p->scratch, *ref);
       if (p->current_token == ',') {
-        p->current_token = lex_next(p->lexer);
+        _parser_advance(p);
       } else if (p->current_token != ')') {
         _throw_expect_but_got(p, ',', ')');
-        return NULL;
+        return false;
       }
-    }
 
-    if (!_parser_expect_next(p, ';')) return NULL;
-
-    p->current_token = lex_next(p->lexer);
+      if (p->current_token == T_EOF) {
+        _throw_expect_but_got(p, ')', T_EOF);
+        return false;
+      }
+      if (p->current_token != ')') return false;
+      node = _parser_close_call(p, f);
+      break;
 
-    return node;
+    default:
+      assert(0 && "unknown kind");
+      break;
   }
 
-  char buf[32];
-  lex_kind_label(p->lexer, p->current_token, buf);
-  printf("[info] lex token: %s\n", buf);
-  assert(0 && "Unhandled token");
+  (void)arrpop(p->frames);
+  *ref = node;
+  return true;
+}
+
+token_t parser_peek(parser_t *p, size_t k) {
+  if (k == 0) return p->current_token;
 
-  return NULL;
+  if (p->stream) {
+    size_t i = p->stream_pos + k;
+    if (i >= p->stream->count) i = p->stream->count - 1;
+    return lex_kind_unpack(p->stream->kinds[i]);
+  }
+
+  return lex_peek_nth(p->lexer, k);
 }
 
-void parser_print_node(ast_node_t *node) {
+// A node being printed, and the index of its next child.
+typedef struct print_step {
+  ast_ref_t ref;
+  uint32_t next;
+} print_step_t;
+
+// Prints node `ref` up to its first child.
+static void _print_open(const ast_t *ast, ast_ref_t ref) {
   assert(A_LAST == 7 && "Implementation missing");
 
-  if (!node) {
+  if (ref == AST_NIL) {
     printf("nil");
     return;
   }
 
-  switch (node->kind) {
+  switch (ast_kind(ast, ref)) {
     case A_STRLIT:
-      printf("(str %s)", node->data.str_val);
+      printf("(str %s)", ast_str(ast, ref));
       break;
 
     case A_I32:
-      printf("(i32 %ld)", node->data.int_val);
+      printf("(i32 %d)", ast_int(ast, ref));
       break;
 
     case A_FUNCALL:
-      printf("(call %s", node->data.funcall.name);
-      for (size_t i = 0; i < node->data.funcall.args.count; i++) {
-        printf(" ");
-        parser_print_node(node->data.funcall.args.items[i]);
-      }
-      printf(")");
+      printf("(call %s", intern_name(ast_name(ast, ref)));
       break;
 
     case A_SCOPE:
       printf("(scope");
-      for (size_t i = 0; i < node->data.statements.count; i++) {
-        printf("\n  ");
-        parser_print_node(node->data.statements.items[i]);
-      }
-      printf(")");
       break;
 
     case A_MAIN:
     case A_FUNDEF:
-      printf("(fdef %s (", node->data.fundef.name);
-      for (size_t i = 0; i < node->data.fundef.args.count; i++) {
-        if (i > 0) printf(" ");
-        parser_print_node(node->data.fundef.args.items[i]);
-      }
-      printf(") ");
-      parser_print_node(node->data.fundef.body);
-      printf(")");
+      printf("(fdef %s (", intern_name(ast_name(ast, ref)));
       break;
 
     case A_VAR_DECLARE:
-      printf("(vdef %s ", node->data.vardeclare.name);
-      parser_print_node(node->data.vardeclare.value);
-      printf(")");
+      printf("(vdef %s ", intern_name(ast_name(ast, ref)));
       break;
 
     default:
-      printf("[info] ast node kind: %d\n", node->kind);
+      printf("[info] ast node kind: %d\n", ast_kind(ast, ref));
       assert(0 && "unknown kind");
       break;
   }
 }
 
+// Stores the i-th child of `ref` in `*child` and prints what goes before it.
+// Returns false past the last one.
+static bool _print_child(const ast_t *ast, ast_ref_t ref, uint32_t i,
+                         ast_ref_t *child) {
+  if (ref == AST_NIL) return false;
+
+  switch (ast_kind(ast, ref)) {
+    case A_FUNCALL: {
+      ast_list_t args = ast_args(ast, ref);
+      if (i >= args.count) return false;
+      printf(" ");
+      *child = args.items[i];
+      return true;
+    }
+
+    case A_SCOPE: {
+      ast_list_t stmts = ast_statements(ast, ref);
+      if (i >= stmts.count) return false;
+      printf("\n  ");
+      *child = stmts.items[i];
+      return true;
+    }
+
+    case A_MAIN:
+    case A_FUNDEF: {
+      // The parameters, then the body.
+      ast_list_t args = ast_args(ast, ref);
+      if (i > args.count) return false;
+      if (i == args.count) {
+        printf(") ");
+        *child = ast_body(ast, ref);
+      } else {
+        if (i > 0) printf(" ");
+        *child = args.items[i];
+      }
+      return true;
+    }
+
+    case A_VAR_DECLARE:
+      *child = ast_value(ast, ref);
+      return i == 0;
+
+    default:
+      return false;
+  }
+}
+
+// Nesting lives on an explicit stack, so any input that parses also prints.
+void parser_print_node(const ast_t *ast, ast_ref_t ref) {
+  print_step_t *steps = NULL;
+  print_step_t step = {ref, 0};
+  _print_open(ast, ref);
+  arrput(steps, step);
+
+  while (arrlenu(steps) > 0) {
+    print_step_t *top = &arrlast(steps);
+    ast_ref_t child;
+    if (_print_child(ast, top->ref, top->next++, &child)) {
+      step = (print_step_t){child, 0};
+      _print_open(ast, child);
+      arrput(steps, step);
+    } else {
+      ast_ref_t done = arrpop(steps).ref;
+      if (done != AST_NIL && ast_kind(ast, done) > A_I32) printf(")");
+    }
+  }
+
+  arrfree(steps);
+}
+
+void ast_print_stats(const ast_t *ast, size_t src_len) {
+  assert(A_LAST == 7 && "Implementation missing");
+  static const char *names[A_LAST] = {"strlit", "i32",  "main",  "scope",
+                                      "funcall", "fundef", "var_declare"};
+  size_t count[A_LAST] = {0}, words[A_LAST] = {0};
+  size_t fixed = 16;  // AST_NIL
+
+  for (ast_ref_t ref = 1; ref < ast->nodes_len; ref += ast_size(ast, ref)) {
+    ast_kind_t kind = ast_kind(ast, ref);
+    count[kind]++;
+    words[kind] += ast_size(ast, ref);
+
+    // The same node as 16 bytes, with its children in a separate list of
+    // {body, argc, args...}, {argc, args...} or statements.
+    fixed += 16;
+    if (kind == A_MAIN || kind == A_FUNDEF)
+      fixed += 4 * (2 + ast_args(ast, ref).count);
+    else if (kind == A_FUNCALL)
+      fixed += 4 * (1 + ast_args(ast, ref).count);
+    else if (kind == A_SCOPE)
+      fixed += 4 * ast_statements(ast, ref).count;
+  }
+
+  size_t nodes = 0, bytes = 4;  // AST_NIL
+  printf("%-12s %10s %12s %10s\n", "kind", "nodes", "bytes", "bytes/node");
+  for (int k = 0; k < A_LAST; ++k) {
+    nodes += count[k];
+    bytes += 4 * words[k];
+    if (count[k] > 0)
+      printf("%-12s %10zu %12zu %10.1f\n", names[k], count[k], 4 * words[k],
+             4.0 * words[k] / count[k]);
+  }
+
+  double kb = src_len > 0 ? src_len / 1024.0 : 1;
+  printf("%-12s %10zu %12zu %10.1f\n", "total", nodes, bytes,
+         nodes ? (double)bytes / nodes : 0.0);
+  printf("%-12s %10s %12zu %10.1f\n", "16B nodes", "", fixed,
+         nodes ? (double)fixed / nodes : 0.0);
+  printf("per source KB: %.1f bytes of nodes (%.1f as 16B nodes), "
+         "%.1f of strings\n", bytes / kb, fixed / kb, ast->strings_len / kb);
+}
+
+static char *_ast_put(char *at, const void *src, size_t size) {
+  if (size) memcpy(at, src, size);
+  return at + size;
+}
+
+ast_t *ast_copy(const ast_t *ast) {
+  size_t nodes = (size_t)ast->nodes_len * sizeof(uint32_t);
+  size_t roots = (size_t)ast->root_count * sizeof(ast_ref_t);
+
+  ast_t *copy = malloc(sizeof(*copy) + nodes + roots + ast->strings_len);
+  if (!copy) return NULL;
+
+  *copy = *ast;
+  copy->map = NULL;
+  copy->map_len = 0;
+
+  char *at = (char *)(copy + 1);
+  copy->nodes = (uint32_t *)at;
+  at = _ast_put(at, ast->nodes, nodes);
+  copy->roots = (ast_ref_t *)at;
+  at = _ast_put(at, ast->roots, roots);
+  copy->strings = at;
+  _ast_put(at, ast->strings, ast->strings_len);
+
+  return copy;
+}
+
+void ast_free(ast_t *ast) {
+  if (ast->map) {
+    munmap(ast->map, ast->map_len);
+    free(ast->names);
+  } else {
+    arrfree(ast->nodes);
+    arrfree(ast->strings);
+    arrfree(ast->roots);
+  }
+  *ast = (ast_t){0};
+}
+
 void parser_free(parser_t *p) {
-  (void)p;
-  arena_free(&ast_arena);
-  p = NULL;
+  ast_free(&p->ast);
+  arena_free(&p->diag_arena);
+  p->diags = p->diags_last = NULL;
+  free(p->consts);
+  arrfree(p->scratch);
+  arrfree(p->frames);
 }
 
 bool _parser_expect(parser_t *p, token_t t) {
@@ -219,16 +844,42 @@ bool _parser_expect(parser_t *p, token_t t) {
 }
 
 bool _parser_expect_next(parser_t *p, token_t t) {
-  p->current_token = lex_next(p->lexer);
+  _parser_advance(p);
   return _parser_expect(p, t);
 }
 
+static void _parser_diag(parser_t *p, const char *msg) {
+  parser_diag_t *d = arena_alloc(&p->diag_arena, sizeof(*d));
+  d->next = NULL;
+  d->offset = _parser_offset(p);
+  d->msg = arena_strdup(&p->diag_arena, msg);
+
+  if (p->diags_last) p->diags_last->next = d;
+  else p->diags = d;
+  p->diags_last = d;
+  p->error_count++;
+}
+
+// Records an error at the current token and resumes parsing at the recovery
+// point.
+static void _throw_error(parser_t *p, const char *msg) {
+  _parser_diag(p, msg);
+
+  assert(p->recover && "Syntax error outside of parser_next");
+  longjmp(*p->recover, 1);
+}
+
 static void _throw_expect_but_got(parser_t *p, token_t t1, token_t t2) {
-  char buf1[256], buf2[256];
+  char buf1[256], buf2[256], msg[sizeof(buf1) + sizeof(buf2) + 32];
+  _parser_sync_lexer(p);
   lex_kind_label(p->lexer, t1, buf1);
   lex_kind_label(p->lexer, t2, buf2);
-  lex_report_err(p->lexer, "Expected token %s but got %s\n", buf1, buf2);
-  lex_free(p->lexer);
-  parser_free(p);
-  exit(1);
+  snprintf(msg, sizeof(msg), "Expected token %s but got %s", buf1, buf2);
+  _throw_error(p, msg);
+}
+
+void parser_report(parser_t *p, size_t skip) {
+  for (parser_diag_t *d = p->diags; d; d = d->next)
+    if (skip > 0) skip--;
+    else lex_report_err_at(p->lexer, d->offset, "%s", d->msg);
 }
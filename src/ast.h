@@ -1,6 +1,10 @@
 #ifndef AST_H
 #define AST_H
 
+#include <setjmp.h>
+#include <stdbool.h>
+
+#include "arena.h"
 #include "lex.h"
 
 typedef enum ast_kind {
@@ -14,56 +18,253 @@ typedef enum ast_kind {
   A_LAST
 } ast_kind_t;
 
-typedef struct ast_node ast_node_t;
+// Index of a node in its ast_t. Word 0 is never used, so AST_NIL can stand
+// for a missing node.
+typedef uint32_t ast_ref_t;
+
+#define AST_NIL 0
+
+// Nodes are stored back to back as 32-bit words, each sized for its kind. A
+// node's ref is the index of its header word, which holds the kind in the
+// low 8 bits and, for some kinds, a small operand above them. Children come
+// before their parent, so lists of children are stored inline:
+//
+//   A_STRLIT       [kind] [offset into `strings`] [length]
+//   A_I32          [kind] [value as two's complement]
+//   A_MAIN/FUNDEF  [kind | argc] [offset] [name] [body] [slots] [args...]
+//   A_SCOPE        [kind] [offset] [count] [statements...]
+//   A_FUNCALL      [kind | argc] [offset] [name] [target] [args...]
+//   A_VAR_DECLARE  [kind | type] [offset] [name] [value] [slot]
+//
+// `offset` is the input offset of the first token, see lex_position(), and
+// `type` the declared type, an ast_kind_t. Literals are shared by every use
+// of their value, so they have no offset. A function body is AST_NIL until
+// parser_body() when it is parsed lazily.
+//
+// `slots`, `slot` and `target` are filled in by resolve.h: the frame size of
+// a function, the frame slot of a local variable, and what a call runs.
+// Variables outside of functions are AST_GLOBAL and live by name. A call
+// target is AST_CALL_BUILTIN | a builtin_t, the ref of a function, or
+// AST_NIL when the function is looked up by name at run time.
+#define AST_HEADER(kind, small) ((uint32_t)(kind) | (uint32_t)(small) << 8)
+#define AST_SMALL_MAX 0xffffffu
+
+#define AST_GLOBAL UINT32_MAX
+#define AST_CALL_BUILTIN 0x80000000u
+
+// A parsed input. Nodes refer to each other by index only, so every array can
+// be moved or written out as it is, see cache.h.
+typedef struct ast {
+  uint32_t *nodes;
+  char *strings;     // string literals, each NUL terminated
+  ast_ref_t *roots;  // top level nodes in input order
+  uint32_t nodes_len, node_count, strings_len, root_count;
+
+  // Symbol ids of a loaded AST, indexed by the name operand of its nodes.
+  // NULL when the names are symbol ids already.
+  sym_t *names;
+
+  // Where the arrays live: stb_ds arrays owned by the AST when `map` is NULL,
+  // otherwise views into a mapping of `map_len` bytes.
+  void *map;
+  size_t map_len;
+} ast_t;
+
+typedef struct ast_list {
+  const ast_ref_t *items;
+  uint32_t count;
+} ast_list_t;
+
+static inline ast_kind_t ast_kind(const ast_t *ast, ast_ref_t ref) {
+  return (ast_kind_t)(ast->nodes[ref] & 0xff);
+}
+
+// Number of words of a node.
+static inline uint32_t ast_size(const ast_t *ast, ast_ref_t ref) {
+  uint32_t small = ast->nodes[ref] >> 8;
+  switch (ast_kind(ast, ref)) {
+    case A_STRLIT: return 3;
+    case A_I32: return 2;
+    case A_MAIN:
+    case A_FUNDEF: return 5 + small;
+    case A_SCOPE: return 3 + ast->nodes[ref + 2];
+    case A_FUNCALL: return 4 + small;
+    case A_VAR_DECLARE: return 5;
+    default: return 1;
+  }
+}
+
+// Input offset of a node other than a literal.
+static inline uint32_t ast_offset(const ast_t *ast, ast_ref_t ref) {
+  return ast->nodes[ref + 1];
+}
+
+// Name of a function, call or variable declaration.
+static inline sym_t ast_name(const ast_t *ast, ast_ref_t ref) {
+  uint32_t name = ast->nodes[ref + 2];
+  return ast->names ? ast->names[name] : name;
+}
+
+// Declared type of a variable.
+static inline ast_kind_t ast_type(const ast_t *ast, ast_ref_t ref) {
+  return (ast_kind_t)(ast->nodes[ref] >> 8);
+}
+
+static inline const char *ast_str(const ast_t *ast, ast_ref_t ref) {
+  return ast->strings + ast->nodes[ref + 1];
+}
+
+static inline uint32_t ast_str_len(const ast_t *ast, ast_ref_t ref) {
+  return ast->nodes[ref + 2];
+}
+
+static inline int32_t ast_int(const ast_t *ast, ast_ref_t ref) {
+  return (int32_t)ast->nodes[ref + 1];
+}
+
+static inline ast_ref_t ast_body(const ast_t *ast, ast_ref_t ref) {
+  return ast->nodes[ref + 3];
+}
+
+static inline ast_ref_t ast_value(const ast_t *ast, ast_ref_t ref) {
+  return ast->nodes[ref + 3];
+}
+
+// Frame size of a function.
+static inline uint32_t ast_slots(const ast_t *ast, ast_ref_t ref) {
+  return ast->nodes[ref + 4];
+}
+
+// Frame slot of a variable, or AST_GLOBAL.
+static inline uint32_t ast_slot(const ast_t *ast, ast_ref_t ref) {
+  return ast->nodes[ref + 4];
+}
+
+static inline uint32_t ast_target(const ast_t *ast, ast_ref_t ref) {
+  return ast->nodes[ref + 3];
+}
 
-typedef struct ast_node_da {
-  size_t count, capacity;
-  struct ast_node **items;
-} ast_node_da_t;
+// Arguments of a call, or parameters of a function.
+static inline ast_list_t ast_args(const ast_t *ast, ast_ref_t ref) {
+  uint32_t at = ref + (ast_kind(ast, ref) == A_FUNCALL ? 4 : 5);
+  return (ast_list_t){ast->nodes + at, ast->nodes[ref] >> 8};
+}
 
-typedef struct ast_node {
+static inline ast_list_t ast_statements(const ast_t *ast, ast_ref_t ref) {
+  return (ast_list_t){ast->nodes + ref + 3, ast->nodes[ref + 2]};
+}
+
+// Prints the number and size of the nodes of each kind, in total and per KB
+// of the `src_len` bytes of input, next to what 16 byte nodes with separate
+// child lists would take.
+void ast_print_stats(const ast_t *ast, size_t src_len);
+
+// Copies `ast` into a single block, released with free() alone. Names of a
+// loaded AST are shared with the original.
+ast_t *ast_copy(const ast_t *ast);
+
+void ast_free(ast_t *ast);
+
+// A literal node and the hash of its value.
+typedef struct parser_const {
+  ast_ref_t ref;
+  uint32_t hash;
+} parser_const_t;
+
+// A syntax error, kept until parser_free.
+typedef struct parser_diag {
+  struct parser_diag *next;
+  uint32_t offset;  // input offset, see lex_position()
+  const char *msg;
+} parser_diag_t;
+
+// A node whose children are still being parsed. It is added to the AST
+// once they are.
+typedef struct parser_frame {
   ast_kind_t kind;
-  union {
-    // Literals
-    char *str_val;
-    long int_val;
-
-    // Function call
-    struct {
-      char *name;
-      ast_node_da_t args;
-    } funcall;
-
-    // Scope
-    ast_node_da_t statements;
-
-    // Function / Main
-    struct {
-      char *name;
-      ast_node_da_t args;
-      ast_node_t *body;
-    } fundef;
-    
-    // Variable declaration
-    struct {
-      ast_kind_t kind;
-      char *name;
-      ast_node_t *value;
-    } vardeclare;
-  } data;
-} ast_node_t;
+  uint8_t type;     // declared type of an A_VAR_DECLARE
+  uint32_t offset;  // of the first token
+  sym_t name;
+  uint32_t mark;    // length of the scratch stack when the node was opened
+} parser_frame_t;
 
 typedef struct parser {
   lex_t *lexer;
   token_t current_token;
+
+  // The AST parsed so far. Parsers do not share state, and each AST lives
+  // until its own parser_free.
+  ast_t ast;
+
+  // Children of the lists being parsed, innermost list last. A list is moved
+  // into its node once it is complete.
+  ast_ref_t *scratch;
+
+  // Nodes being parsed, innermost last. Nesting lives here rather than on the
+  // C stack, so it is only limited by memory.
+  parser_frame_t *frames;
+
+  // Syntax errors in input order, allocated from `diag_arena`. After an
+  // error the parser drops the statement it was in and goes on, so a single
+  // run finds every error.
+  Arena diag_arena;
+  parser_diag_t *diags, *diags_last;
+  size_t error_count;
+
+  // Set once the lexer's error, see lex_t.error, is among the errors.
+  bool input_failed;
+
+  // Where a syntax error resumes parsing.
+  jmp_buf *recover;
+
+  // Skip function bodies by brace matching and leave their body AST_NIL
+  // until parser_body() is called, when the whole input stays in memory.
+  bool lazy;
+
+  // Constant leaves of `ast` by content, so that equal literals share one
+  // node and compare equal by ref: open addressing table, AST_NIL marks an
+  // empty slot.
+  parser_const_t *consts;
+  size_t consts_capacity;
+  size_t consts_count;
+
+  // Pre-lexed input, walked by index instead of calling lex_next.
+  lex_stream_t *stream;
+  size_t stream_pos;
 } parser_t;
 
 void parser_init(parser_t *p, lex_t *lexer);
 
-ast_node_t *parser_next(parser_t *p);
+// Parses from a token stream produced by lex_stream_init(). The lexer is only
+// used for its input and for diagnostics.
+void parser_init_stream(parser_t *p, lex_t *lexer, lex_stream_t *ts);
+
+// Parses the next top level item and appends it to `p->ast.roots`. Returns
+// AST_NIL at the end of the input. Statements with syntax errors are left
+// out and counted in `p->error_count`. The counts of `p->ast` are up to date
+// whenever it returns.
+ast_ref_t parser_next(parser_t *p);
+
+// Starts a new AST, reusing the storage of the current one.
+void parser_reset_ast(parser_t *p);
+
+// Parses the body of function `fn` if it was skipped by a lazy parse, once
+// the whole input is parsed, and returns it. Returns AST_NIL when the body
+// has a syntax error.
+ast_ref_t parser_body(parser_t *p, ast_ref_t fn);
+
+// Returns the token k positions after the current one without consuming
+// anything; k == 0 is the current token. At most LEX_LOOKAHEAD, unless
+// parsing a token stream.
+token_t parser_peek(parser_t *p, size_t k);
+
+void parser_print_node(const ast_t *ast, ast_ref_t ref);
 
-void parser_print_node(ast_node_t *node);
+// Writes the syntax errors after the first `skip` ones like lex_report_err.
+void parser_report(parser_t *p, size_t skip);
 
+// Releases the AST and diagnostics of this parser; other parsers are not
+// affected.
 void parser_free(parser_t *p);
 
 #endif /* ifndef AST_H */
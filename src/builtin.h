@@ -0,0 +1,33 @@
+#ifndef BUILTIN_H
+#define BUILTIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Functions the interpreter provides, as X(id, name, arity, variadic): calls
+// pass `arity` arguments, or more when `variadic`. Each gets a builtin_t in
+// list order, and its name a symbol of its own, see intern.h.
+#define BUILTINS(X)       \
+  X(PRINTF, printf, 1, true) \
+  X(FLUSH, flush, 0, false)
+
+typedef enum builtin {
+#define BUILTIN_ID(id, name, arity, variadic) BUILTIN_##id,
+  BUILTINS(BUILTIN_ID)
+#undef BUILTIN_ID
+  BUILTIN_LAST
+} builtin_t;
+
+typedef struct builtin_info {
+  const char *name;
+  uint32_t arity;
+  bool variadic;
+} builtin_info_t;
+
+static const builtin_info_t builtin_info[BUILTIN_LAST] = {
+#define BUILTIN_INFO(id, name, arity, variadic) {#name, arity, variadic},
+  BUILTINS(BUILTIN_INFO)
+#undef BUILTIN_INFO
+};
+
+#endif /* ifndef BUILTIN_H */
@@ -0,0 +1,324 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "intern.h"
+
+#ifndef COMPILER_VERSION
+#define COMPILER_VERSION "unknown"
+#endif
+
+// Bump whenever the entry layout or the node layout changes.
+#define CACHE_FORMAT 4
+
+#define CACHE_MAGIC "CPAC"
+
+// An entry is this header followed by the node words, roots, name offsets,
+// string pool and names, in the host's byte order. Names are stored
+// once each and nodes refer to them by index, since symbol ids differ from
+// run to run.
+typedef struct cache_header {
+  char magic[4];
+  uint32_t format;
+  uint64_t key;
+  uint64_t src_len;
+  uint32_t nodes_len, node_count, strings_len, root_count;
+  uint32_t name_count, names_len;
+} cache_header_t;
+
+static uint64_t _cache_hash(const void *data, size_t len, uint64_t h) {
+  const unsigned char *p = data;
+  const uint64_t k1 = 0x9e3779b97f4a7c15ull, k2 = 0xc2b2ae3d27d4eb4full;
+
+  h ^= len * k1;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h ^= w * k1;
+    h = ((h << 31) | (h >> 33)) * k2;
+  }
+  for (; len > 0; p++, len--) h = (h ^ *p) * k1;
+
+  // Final avalanche, from MurmurHash3.
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t cache_key(const char *src, size_t len) {
+  const char *version = COMPILER_VERSION;
+  uint64_t h = _cache_hash(version, strlen(version), CACHE_FORMAT);
+  return _cache_hash(src, len, h);
+}
+
+static int _cache_path(char *path, const char *dir, uint64_t key,
+                       const char *suffix) {
+  int n = snprintf(path, PATH_MAX, "%s/%016llx%s", dir,
+                   (unsigned long long)key, suffix);
+  return n > 0 && n < PATH_MAX ? 0 : -1;
+}
+
+// Whether a node of kind `kind` has a name, see ast_name().
+static int _cache_named(uint8_t kind) {
+  assert(A_LAST == 7 && "Implementation missing");
+  return kind == A_MAIN || kind == A_FUNDEF || kind == A_FUNCALL ||
+         kind == A_VAR_DECLARE;
+}
+
+// Whether `ref` is a node before `parent`, or AST_NIL when `nil` is set.
+static bool _cache_child(const uint8_t *starts, ast_ref_t ref,
+                         ast_ref_t parent, bool nil) {
+  return ref == AST_NIL ? nil : ref < parent && starts[ref];
+}
+
+// Checks that every node of a loaded entry lies within `nodes_len`, and that
+// its names, strings and children are in range, so nothing that reads the
+// AST can go astray. Children must come before their parent, as the parser
+// writes them, which also rules out cycles.
+static bool _cache_check(const ast_t *ast, uint32_t name_count) {
+  assert(A_LAST == 7 && "Implementation missing");
+  static const uint8_t min_size[A_LAST] = {
+      [A_STRLIT] = 3, [A_I32] = 2,   [A_MAIN] = 5,        [A_SCOPE] = 3,
+      [A_FUNCALL] = 4, [A_FUNDEF] = 5, [A_VAR_DECLARE] = 5,
+  };
+
+  // Which words start a node.
+  uint8_t *starts = calloc(ast->nodes_len, 1);
+  if (!starts) return false;
+
+  bool ok = true;
+  uint32_t count = 0;
+  ast_ref_t ref = 1;
+  for (; ok && ref < ast->nodes_len; ref += ast_size(ast, ref), ++count) {
+    ast_kind_t kind = ast_kind(ast, ref);
+    uint32_t left = ast->nodes_len - ref;
+    if (kind >= A_LAST || left < min_size[kind] ||
+        (uint64_t)ast_size(ast, ref) > left ||
+        (kind == A_SCOPE && ast->nodes[ref + 2] > left - 3)) {
+      ok = false;
+      break;
+    }
+    starts[ref] = 1;
+
+    if (_cache_named(kind) && ast->nodes[ref + 2] >= name_count) ok = false;
+
+    switch (kind) {
+      case A_STRLIT: {
+        uint64_t end = (uint64_t)ast->nodes[ref + 1] + ast->nodes[ref + 2];
+        ok = end < ast->strings_len && ast->strings[end] == '\0';
+      } break;
+
+      case A_MAIN:
+      case A_FUNDEF:
+        ok = ok && _cache_child(starts, ast_body(ast, ref), ref, true);
+        // fallthrough
+
+      case A_FUNCALL: {
+        ast_list_t args = ast_args(ast, ref);
+        for (uint32_t i = 0; ok && i < args.count; ++i)
+          ok = _cache_child(starts, args.items[i], ref, false);
+        if (kind != A_FUNCALL) break;
+
+        // The resolver binds calls again on load, and the function may be
+        // defined further on, so the target only has to be in range.
+        uint32_t target = ast_target(ast, ref);
+        if (target & AST_CALL_BUILTIN)
+          ok = ok && (target & ~AST_CALL_BUILTIN) < BUILTIN_LAST;
+        else
+          ok = ok && (target == AST_NIL || target < ast->nodes_len);
+      } break;
+
+      case A_SCOPE: {
+        ast_list_t stmts = ast_statements(ast, ref);
+        for (uint32_t i = 0; ok && i < stmts.count; ++i)
+          ok = _cache_child(starts, stmts.items[i], ref, false);
+      } break;
+
+      case A_VAR_DECLARE:
+        ok = ok && ast_type(ast, ref) < A_LAST &&
+             _cache_child(starts, ast_value(ast, ref), ref, false);
+        break;
+
+      default:
+        break;
+    }
+  }
+  ok = ok && ref == ast->nodes_len && count == ast->node_count;
+
+  for (uint32_t i = 0; ok && i < ast->root_count; ++i)
+    ok = _cache_child(starts, ast->roots[i], ast->nodes_len, false);
+
+  free(starts);
+  return ok;
+}
+
+int cache_load(const char *dir, uint64_t key, size_t src_len, ast_t *ast) {
+  char path[PATH_MAX];
+  if (_cache_path(path, dir, key, ".ast") < 0) return 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cache_header_t))
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+
+  const cache_header_t *h = map;
+  size_t words = (size_t)h->nodes_len + h->root_count + h->name_count;
+  size_t size = sizeof(*h) + words * sizeof(uint32_t) + h->strings_len +
+                h->names_len;
+
+  if (memcmp(h->magic, CACHE_MAGIC, 4) != 0 || h->format != CACHE_FORMAT ||
+      h->key != key || h->src_len != src_len || h->nodes_len == 0 ||
+      size != (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  const char *at = (const char *)(h + 1);
+  *ast = (ast_t){
+      .nodes_len = h->nodes_len,
+      .node_count = h->node_count,
+      .strings_len = h->strings_len,
+      .root_count = h->root_count,
+      .map = map,
+      .map_len = st.st_size,
+  };
+  ast->nodes = (uint32_t *)at;
+  at += (size_t)h->nodes_len * sizeof(uint32_t);
+  ast->roots = (ast_ref_t *)at;
+  at += (size_t)h->root_count * sizeof(uint32_t);
+  const uint32_t *offsets = (const uint32_t *)at;
+  at += (size_t)h->name_count * sizeof(uint32_t);
+  ast->strings = (char *)at;
+  const char *names = at + h->strings_len;
+
+  // Nothing is interned for an entry that turns out to be broken.
+  if (!_cache_check(ast, h->name_count)) {
+    ast_free(ast);
+    return 0;
+  }
+
+  ast->names = malloc((h->name_count + 1) * sizeof(sym_t));
+  if (!ast->names) {
+    ast_free(ast);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < h->name_count; ++i) {
+    uint32_t end = i + 1 < h->name_count ? offsets[i + 1] : h->names_len;
+    if (offsets[i] >= end || end > h->names_len || names[end - 1] != '\0') {
+      ast_free(ast);
+      return 0;
+    }
+    ast->names[i] = intern(names + offsets[i], end - offsets[i] - 1);
+  }
+
+  return 1;
+}
+
+// fwrite(), for arrays that are NULL when empty.
+static bool _cache_write(const void *p, size_t size, size_t n, FILE *f) {
+  return n == 0 || fwrite(p, size, n, f) == n;
+}
+
+int cache_store(const char *dir, uint64_t key, size_t src_len,
+                const ast_t *ast) {
+  char path[PATH_MAX], tmp[PATH_MAX];
+  if (_cache_path(path, dir, key, ".ast") < 0 ||
+      _cache_path(tmp, dir, key, ".XXXXXX") < 0)
+    return -1;
+
+  int fd = mkstemp(tmp);
+  if (fd < 0 && errno == ENOENT && mkdir(dir, 0777) == 0) {
+    _cache_path(tmp, dir, key, ".XXXXXX");
+    fd = mkstemp(tmp);
+  }
+  if (fd < 0) return -1;
+  fchmod(fd, 0644);
+
+  FILE *f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+
+  // Number the names in order of first use; `local` holds that number + 1.
+  uint32_t *local = calloc(intern_count() + 1, sizeof(*local));
+  sym_t *order = malloc((ast->node_count + 1) * sizeof(*order));
+  cache_header_t h = {
+      .magic = CACHE_MAGIC,
+      .format = CACHE_FORMAT,
+      .key = key,
+      .src_len = src_len,
+      .nodes_len = ast->nodes_len,
+      .node_count = ast->node_count,
+      .strings_len = ast->strings_len,
+      .root_count = ast->root_count,
+  };
+  int ok = local && order;
+
+  for (ast_ref_t i = 1; ok && i < ast->nodes_len; i += ast_size(ast, i)) {
+    if (!_cache_named(ast_kind(ast, i))) continue;
+    sym_t id = ast_name(ast, i);
+    if (local[id]) continue;
+    order[h.name_count] = id;
+    local[id] = ++h.name_count;
+    h.names_len += intern_len(id) + 1;
+  }
+
+  ok = ok && fwrite(&h, sizeof(h), 1, f) == 1;
+
+  // Nodes go out as they are, up to each name, which is renumbered.
+  uint32_t done = 0;
+  for (ast_ref_t i = 1; ok && i < ast->nodes_len; i += ast_size(ast, i)) {
+    if (!_cache_named(ast_kind(ast, i))) continue;
+    uint32_t name = local[ast_name(ast, i)] - 1;
+    ok = fwrite(ast->nodes + done, sizeof(uint32_t), i + 2 - done, f) ==
+             i + 2 - done &&
+         fwrite(&name, sizeof(name), 1, f) == 1;
+    done = i + 3;
+  }
+  ok = ok && fwrite(ast->nodes + done, sizeof(uint32_t), ast->nodes_len - done,
+                    f) == ast->nodes_len - done;
+  ok = ok && _cache_write(ast->roots, sizeof(uint32_t), ast->root_count, f);
+
+  uint32_t offset = 0;
+  for (uint32_t i = 0; ok && i < h.name_count; ++i) {
+    ok = fwrite(&offset, sizeof(offset), 1, f) == 1;
+    offset += intern_len(order[i]) + 1;
+  }
+
+  ok = ok && _cache_write(ast->strings, 1, ast->strings_len, f);
+  for (uint32_t i = 0; ok && i < h.name_count; ++i)
+    ok = fwrite(intern_name(order[i]), 1, intern_len(order[i]) + 1, f) ==
+         intern_len(order[i]) + 1;
+
+  free(local);
+  free(order);
+
+  if (fclose(f) != 0) ok = 0;
+  if (ok && rename(tmp, path) == 0) return 0;
+
+  unlink(tmp);
+  return -1;
+}
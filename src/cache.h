@@ -0,0 +1,28 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ast.h"
+
+// Parsed ASTs kept on disk between runs, one file per source in a cache
+// directory. Entries are named after cache_key() of the source, so a changed
+// source or a different compiler simply misses.
+
+// Hash of the source bytes, the compiler version and the entry format.
+uint64_t cache_key(const char *src, size_t len);
+
+// Maps the entry for `key` into `ast`, which is used in place and released
+// with ast_free(). The mapping is private, so the AST can be resolved again
+// without touching the file. Only the symbol names are interned on load.
+// Returns 1 on a hit, 0 when there is no usable entry.
+int cache_load(const char *dir, uint64_t key, size_t src_len, ast_t *ast);
+
+// Writes `ast`, parsed from the `src_len` bytes of `key`, creating `dir` if
+// needed. The entry is written to a temporary file and renamed into place, so
+// processes storing and loading the same entry at once never see half of it.
+int cache_store(const char *dir, uint64_t key, size_t src_len,
+                const ast_t *ast);
+
+#endif /* ifndef CACHE_H */
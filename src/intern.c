@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "intern.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define INTERN_INIT_SLOTS 1024
+
+// Entries live in blocks of doubling size that never move, so a name can be
+// read without the lock while other threads intern new symbols. Block `b`
+// holds 1 << (INTERN_BLOCK_BITS + b) entries.
+#define INTERN_BLOCK_BITS 10
+#define INTERN_BLOCKS 22
+
+typedef struct intern_entry {
+  const char *name;
+  uint32_t len;
+  uint32_t hash;
+} intern_entry_t;
+
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static Arena intern_arena = {0};
+static intern_entry_t *blocks[INTERN_BLOCKS];
+// Written under the lock, and read without it by intern_name().
+static size_t count;
+
+// Open addressing table of entry index + 1; 0 marks an empty slot.
+static uint32_t *slots;
+static size_t slots_capacity;
+
+static void _intern_init(void);
+
+static inline intern_entry_t *_entry(sym_t id) {
+  size_t v = (size_t)id + (1u << INTERN_BLOCK_BITS);
+  int top = 63 - __builtin_clzll(v);
+  return &blocks[top - INTERN_BLOCK_BITS][v - ((size_t)1 << top)];
+}
+
+static void _intern_grow(void) {
+  size_t capacity = slots_capacity ? slots_capacity * 2 : INTERN_INIT_SLOTS;
+  uint32_t *grown = calloc(capacity, sizeof(*grown));
+  assert(grown && "Out of memory");
+
+  for (size_t i = 0; i < count; ++i) {
+    size_t at = _entry(i)->hash & (capacity - 1);
+    while (grown[at]) at = (at + 1) & (capacity - 1);
+    grown[at] = i + 1;
+  }
+
+  free(slots);
+  slots = grown;
+  slots_capacity = capacity;
+}
+
+uint32_t intern_hash(const char *s, size_t len) {
+  uint32_t h = INTERN_HASH_INIT;
+  for (size_t i = 0; i < len; ++i) h = intern_hash_step(h, s[i]);
+  return h;
+}
+
+sym_t intern(const char *s, size_t len) {
+  return intern_hashed(s, len, intern_hash(s, len));
+}
+
+static sym_t _intern_locked(const char *s, size_t len, uint32_t hash) {
+  if (!slots) _intern_init();
+
+  size_t at = hash & (slots_capacity - 1);
+  while (slots[at]) {
+    intern_entry_t *e = _entry(slots[at] - 1);
+    if (e->hash == hash && e->len == len && memcmp(e->name, s, len) == 0)
+      return slots[at] - 1;
+    at = (at + 1) & (slots_capacity - 1);
+  }
+
+  sym_t id = count;
+  size_t v = (size_t)id + (1u << INTERN_BLOCK_BITS);
+  if ((v & (v - 1)) == 0) {
+    // First entry of a new block.
+    int block = 63 - __builtin_clzll(v) - INTERN_BLOCK_BITS;
+    assert(block < INTERN_BLOCKS && "Too many symbols");
+    blocks[block] = malloc(v * sizeof(intern_entry_t));
+    assert(blocks[block] && "Out of memory");
+  }
+
+  char *name = arena_alloc(&intern_arena, len + 1);
+  memcpy(name, s, len);
+  name[len] = '\0';
+
+  intern_entry_t *e = _entry(id);
+  e->name = name;
+  e->len = len;
+  e->hash = hash;
+  __atomic_store_n(&count, count + 1, __ATOMIC_RELEASE);
+  slots[at] = id + 1;
+
+  if (count * 2 > slots_capacity) _intern_grow();
+
+  return id;
+}
+
+sym_t intern_hashed(const char *s, size_t len, uint32_t hash) {
+  pthread_mutex_lock(&intern_lock);
+  sym_t id = _intern_locked(s, len, hash);
+  pthread_mutex_unlock(&intern_lock);
+  return id;
+}
+
+sym_t intern_cached(intern_cache_t *c, const char *s, size_t len,
+                    uint32_t hash) {
+  size_t at = hash & (INTERN_CACHE_SIZE - 1);
+  if (c->ids[at] && c->hashes[at] == hash) {
+    intern_entry_t *e = _entry(c->ids[at] - 1);
+    if (e->len == len && memcmp(e->name, s, len) == 0) return c->ids[at] - 1;
+  }
+
+  sym_t id = intern_hashed(s, len, hash);
+  c->hashes[at] = hash;
+  c->ids[at] = id + 1;
+  return id;
+}
+
+// Ids are only handed out after their entry is written, under the lock, so
+// whoever holds an id can read its entry without taking it.
+const char *intern_name(sym_t id) {
+  assert(id < __atomic_load_n(&count, __ATOMIC_ACQUIRE) && "Unknown symbol");
+  return _entry(id)->name;
+}
+
+size_t intern_len(sym_t id) {
+  assert(id < __atomic_load_n(&count, __ATOMIC_ACQUIRE) && "Unknown symbol");
+  return _entry(id)->len;
+}
+
+size_t intern_count(void) {
+  pthread_mutex_lock(&intern_lock);
+  size_t n = count;
+  pthread_mutex_unlock(&intern_lock);
+  return n;
+}
+
+void intern_free(void) {
+  pthread_mutex_lock(&intern_lock);
+  for (size_t i = 0; i < INTERN_BLOCKS; ++i) {
+    free(blocks[i]);
+    blocks[i] = NULL;
+  }
+  count = 0;
+  free(slots);
+  slots = NULL;
+  slots_capacity = 0;
+  arena_free(&intern_arena);
+  pthread_mutex_unlock(&intern_lock);
+}
+
+static void _intern_init(void) {
+  assert(SYM_LAST == SYM_BUILTINS + BUILTIN_LAST && "Implementation missing");
+
+  _intern_grow();
+
+  sym_t id;
+  id = _intern_locked("i32", 3, intern_hash("i32", 3));
+  assert(id == SYM_I32);
+  id = _intern_locked("main", 4, intern_hash("main", 4));
+  assert(id == SYM_MAIN);
+  for (uint32_t i = 0; i < BUILTIN_LAST; ++i) {
+    const char *name = builtin_info[i].name;
+    size_t len = strlen(name);
+    id = _intern_locked(name, len, intern_hash(name, len));
+    assert(id == SYM_BUILTINS + i);
+  }
+  (void)id;
+}
@@ -0,0 +1,69 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "builtin.h"
+
+// Dense identifier of an interned symbol, shared by the lexer, parser and
+// interpreter. Ids start at 0 and are stable for the lifetime of the table.
+// Interning is safe from several threads at once.
+typedef uint32_t sym_t;
+
+// Symbols the compiler itself needs to recognize. They are interned first,
+// in this order, so their ids are compile time constants.
+typedef enum intern_builtin {
+  SYM_I32 = 0,
+  SYM_MAIN,
+  // Builtin functions, in builtin_t order from SYM_BUILTINS on.
+#define INTERN_BUILTIN(id, name, arity, variadic) SYM_##id,
+  BUILTINS(INTERN_BUILTIN)
+#undef INTERN_BUILTIN
+  SYM_LAST
+} intern_builtin_t;
+
+#define SYM_BUILTINS (SYM_MAIN + 1)
+
+// Builtin named `id`, or BUILTIN_LAST when it names none.
+static inline builtin_t sym_builtin(sym_t id) {
+  uint32_t i = id - SYM_BUILTINS;
+  return i < BUILTIN_LAST ? (builtin_t)i : BUILTIN_LAST;
+}
+
+#define INTERN_HASH_INIT 2166136261u
+
+// FNV-1a, one byte at a time so the lexer can fold it into its scan loop.
+static inline uint32_t intern_hash_step(uint32_t h, unsigned char ch) {
+  return (h ^ ch) * 16777619u;
+}
+
+uint32_t intern_hash(const char *s, size_t len);
+
+sym_t intern(const char *s, size_t len);
+
+// Like intern(), for callers that already computed intern_hash(s, len).
+sym_t intern_hashed(const char *s, size_t len, uint32_t hash);
+
+// Direct mapped cache of recent lookups, private to one lexer. Hits never
+// touch the shared table or its lock. Ids are stored + 1; 0 marks an empty
+// slot. Must be zeroed before use and dropped before intern_free().
+#define INTERN_CACHE_SIZE 4096
+
+typedef struct intern_cache {
+  uint32_t hashes[INTERN_CACHE_SIZE];
+  sym_t ids[INTERN_CACHE_SIZE];
+} intern_cache_t;
+
+sym_t intern_cached(intern_cache_t *c, const char *s, size_t len,
+                    uint32_t hash);
+
+const char *intern_name(sym_t id);
+
+size_t intern_len(sym_t id);
+
+size_t intern_count(void);
+
+void intern_free(void);
+
+#endif /* ifndef INTERN_H */
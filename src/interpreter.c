@@ -1,84 +1,1027 @@
 #include "interpreter.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 // #include "arena.h"
 #include "ast.h"
+#include "builtin.h"
+#include "output.h"
+#include "resolve.h"
 #include "stb_ds.h"
 
 // static Arena interpreter_arena = {0};
-static interpreter_functions_t *functions;
-static interpreter_variables_t *variables;
 
-static void _interpreter_execute(ast_node_t *node);
-static void _builtin_printf(ast_node_da_t *args);
+// A node and the AST it belongs to. Top level items may each come with their
+// own AST, see interpreter_feed().
+typedef struct interpreter_ref {
+  const ast_t *ast;
+  ast_ref_t ref;
+} interpreter_ref_t;
 
-void interpreter_run(ast_node_da_t *list) {
-  for (size_t i = 0; i < list->count; ++i) _interpreter_execute(list->items[i]);
+// A defined function, and its VM function once the VM needed it, 0 before.
+// `ran` once a definition of the name ran, and `called` once a call ran one
+// that was only read ahead.
+typedef struct interpreter_function {
+  const ast_t *ast;
+  ast_ref_t ref;
+  uint32_t vm;
+  bool ran;
+  bool called;
+} interpreter_function_t;
 
-  if (shgetp(functions, "main") == NULL)
+// A value as the program sees it. The string of an A_STRLIT is `data` bytes
+// into the strings of the AST of the code that made it.
+typedef struct interpreter_value {
+  ast_kind_t kind;  // A_STRLIT, A_I32, or A_LAST for anything else
+  uint32_t data;
+} interpreter_value_t;
+
+static interpreter_feed_t *feed;
+static parser_t *lazy;
+
+// Walk the AST instead of running bytecode, see interpreter_select().
+static bool walk;
+
+// The walker recurses on the C stack, one level per nested node or call. It
+// stops the run rather than overflow it.
+#define WALK_MAX_DEPTH (1u << 14)
+static uint32_t walk_depth;
+
+// Resolves the bodies `lazy` parses on demand.
+static resolver_t resolver;
+
+// Set when every top level definition was registered before the run, see
+// interpreter_run().
+static bool hoisted;
+
+// Both tables are indexed by symbol id. Variables declared in functions live
+// in `stack` instead.
+static interpreter_function_t *functions;
+static interpreter_value_t *globals;
+
+// Frames of the running functions: the values of the local variables of
+// each, see resolve.h, then the operands of the VM. The running function's
+// frame starts at `frame`.
+static interpreter_value_t *stack;
+static size_t frame;
+
+// Arguments of the builtin the walker calls.
+static interpreter_value_t *builtin_args;
+
+// Items read ahead of the one running, in input order, from `pending_head`.
+static interpreter_ref_t *pending;
+static size_t pending_head;
+
+// Items that definitions refer to, released at the end.
+static interpreter_ref_t *kept;
+
+// The AST of the node being executed, and whether a definition in the
+// current item's AST was registered.
+static const ast_t *ast;
+static const ast_t *item_ast;
+static bool item_kept;
+
+// Set once a lazily parsed body turns out to have an error, the feed ends
+// early, or calls nest too deep.
+static bool stopped;
+
+// Set once flush() failed to write the output, reported at the end.
+static bool output_lost;
+
+static void _interpreter_execute(ast_ref_t ref);
+static void _interpreter_walk(ast_ref_t ref);
+static void _vm_item(interpreter_ref_t item);
+static void _vm_free(void);
+static void _vm_print_stats(void);
+
+#define BUILTIN_DECLARE(id, name, arity, variadic)                       \
+  static void _builtin_##name(const ast_t *ast,                          \
+                              const interpreter_value_t *args, uint32_t argc);
+BUILTINS(BUILTIN_DECLARE)
+#undef BUILTIN_DECLARE
+
+// Indexed by builtin_t. The strings of `args` are in `ast`.
+static void (*const builtins[BUILTIN_LAST])(const ast_t *ast,
+                                            const interpreter_value_t *args,
+                                            uint32_t argc) = {
+#define BUILTIN_FN(id, name, arity, variadic) _builtin_##name,
+    BUILTINS(BUILTIN_FN)
+#undef BUILTIN_FN
+};
+
+int interpreter_select(const char *engine) {
+  if (strcmp(engine, "vm") == 0) walk = false;
+  else if (strcmp(engine, "walk") == 0) walk = true;
+  else return -1;
+  return 0;
+}
+
+static void _ensure_symbols(void) {
+  // Builtins are only interned once a symbol is seen.
+  size_t count = intern_count();
+  if (count < SYM_LAST) count = SYM_LAST;
+  interpreter_function_t none = {NULL, AST_NIL, 0, false, false};
+  interpreter_value_t nil = {A_LAST, 0};
+  while (arrlenu(functions) < count) arrput(functions, none);
+  while (arrlenu(globals) < count) arrput(globals, nil);
+}
+
+// Value of node `ref` as it is written; only literals have one.
+static interpreter_value_t _interpreter_value(const ast_t *from,
+                                              ast_ref_t ref) {
+  ast_kind_t kind = ast_kind(from, ref);
+  if (kind == A_STRLIT || kind == A_I32)
+    return (interpreter_value_t){kind, from->nodes[ref + 1]};
+  return (interpreter_value_t){A_LAST, 0};
+}
+
+// Registers function `ref` of `from`, which is VM function `vm` if not 0.
+static void _interpreter_define(const ast_t *from, ast_ref_t ref,
+                                uint32_t vm) {
+  interpreter_function_t *fn = &functions[ast_name(from, ref)];
+  *fn = (interpreter_function_t){from, ref, vm, true, fn->called};
+  if (from == item_ast) item_kept = true;
+}
+
+static void _interpreter_store_global(const ast_t *from, sym_t name,
+                                      interpreter_value_t value) {
+  globals[name] = value;
+  if (from == item_ast) item_kept = true;
+}
+
+// Takes the next top level item from the feed. Functions it defines are known
+// from then on, so calls can be made before the definition runs. As in a run
+// of the whole input, a later definition replaces one read ahead, but not one
+// that ran.
+static bool _interpreter_pull(interpreter_ref_t *item) {
+  if (!feed->next(feed->ctx, &item->ast, &item->ref)) {
+    // Whatever was missing may have been in the part that did not parse.
+    if (feed->failed && feed->failed(feed->ctx)) stopped = true;
+    return false;
+  }
+
+  _ensure_symbols();
+  if (hoisted || ast_kind(item->ast, item->ref) != A_FUNDEF) return true;
+
+  // A call already ran an earlier one, where the whole input runs this.
+  sym_t name = ast_name(item->ast, item->ref);
+  interpreter_function_t *fn = &functions[name];
+  if (fn->called) {
+    fprintf(stderr,
+            "Error: Function '%s' is defined again after a call to it ran "
+            "an earlier definition\n",
+            intern_name(name));
+    stopped = true;
+  }
+  if (!fn->ran)
+    *fn = (interpreter_function_t){item->ast, item->ref, 0, false, false};
+  return true;
+}
+
+// Looks up a function, reading ahead in the feed when it is not defined yet.
+static interpreter_function_t _interpreter_function(sym_t name) {
+  interpreter_ref_t item;
+  while (!functions[name].ast && _interpreter_pull(&item))
+    arrput(pending, item);
+  if (stopped) return (interpreter_function_t){NULL, AST_NIL, 0, false, false};
+  if (functions[name].ast && !functions[name].ran)
+    functions[name].called = true;
+  return functions[name];
+}
+
+// Returns the body of function `fn` of `from`, parsing it first if a lazy
+// parse skipped it. Returns AST_NIL, and stops the run, when it has errors.
+static ast_ref_t _interpreter_body(const ast_t *from, ast_ref_t fn) {
+  ast_ref_t body = ast_body(from, fn);
+  if (body != AST_NIL || !lazy || from != &lazy->ast) return body;
+
+  size_t errors = lazy->error_count;
+  body = parser_body(lazy, fn);
+  if (lazy->error_count > errors) {
+    parser_report(lazy, errors);
+    stopped = true;
+  } else if (resolve_function(&resolver, &lazy->ast, fn) > 0) {
+    stopped = true;
+    body = AST_NIL;
+  }
+  return body;
+}
+
+// Runs `body` with a frame of `size` slots.
+static void _interpreter_call(ast_ref_t body, uint32_t size) {
+  size_t caller = frame;
+  interpreter_value_t nil = {A_LAST, 0};
+  frame = arrlenu(stack);
+  for (uint32_t i = 0; i < size; ++i) arrput(stack, nil);
+
+  _interpreter_execute(body);
+
+  arrsetlen(stack, frame);
+  frame = caller;
+}
+
+static void _interpreter_item(interpreter_ref_t item) {
+  ast = item_ast = item.ast;
+  item_kept = false;
+
+  if (walk) _interpreter_execute(item.ref);
+  else _vm_item(item);
+
+  if (item_kept) arrput(kept, item);
+  else if (feed->release) feed->release(feed->ctx, item.ast, item.ref);
+}
+
+int interpreter_feed(interpreter_feed_t *f, parser_t *parser) {
+  feed = f;
+  lazy = parser;
+  stopped = false;
+  output_lost = false;
+  if (lazy) {
+    resolver_init(&resolver, lazy->lexer);
+    resolver.check_calls = false;
+    resolver.bind_calls = false;
+  }
+  _ensure_symbols();
+
+  while (!stopped) {
+    interpreter_ref_t item;
+    if (pending_head < arrlenu(pending)) {
+      item = pending[pending_head++];
+    } else {
+      arrfree(pending);
+      pending_head = 0;
+      if (!_interpreter_pull(&item)) break;
+    }
+    _interpreter_item(item);
+  }
+
+  if (!stopped && !functions[SYM_MAIN].ast)
     fprintf(stderr, "Error: Missing entry point main.\n");
 
-  shfree(functions);
-  shfree(variables);
+  // Items read ahead but never run.
+  for (size_t i = pending_head; feed->release && i < arrlenu(pending); ++i)
+    feed->release(feed->ctx, pending[i].ast, pending[i].ref);
+
+  for (size_t i = 0; feed->release && i < arrlenu(kept); ++i)
+    feed->release(feed->ctx, kept[i].ast, kept[i].ref);
+
+  if (output_flush() < 0 || output_lost) {
+    fprintf(stderr, "Error: Could not write the output\n");
+    stopped = true;
+  }
+
+  if (!walk) _vm_print_stats();
+  _vm_free();
+  arrfree(functions);
+  arrfree(globals);
+  arrfree(stack);
+  arrfree(builtin_args);
+  resolver_free(&resolver);
+  arrfree(kept);
+  arrfree(pending);
+  pending_head = 0;
+  hoisted = false;
+  feed = NULL;
+  lazy = NULL;
+  ast = item_ast = NULL;
   // arena_free(&interpreter_arena);
+  return stopped ? -1 : 0;
+}
+
+typedef struct interpreter_roots {
+  const ast_t *ast;
+  uint32_t next;
+} interpreter_roots_t;
+
+static bool _roots_next(void *ctx, const ast_t **ast, ast_ref_t *root) {
+  interpreter_roots_t *r = ctx;
+  if (r->next >= r->ast->root_count) return false;
+  *ast = r->ast;
+  *root = r->ast->roots[r->next++];
+  return true;
+}
+
+int interpreter_run(const ast_t *tree, parser_t *parser) {
+  interpreter_roots_t roots = {tree, 0};
+  interpreter_feed_t f = {_roots_next, NULL, NULL, &roots};
+
+  // All of the input is known, so a call before any definition ran gets the
+  // last one, and nothing is read ahead.
+  _ensure_symbols();
+  for (uint32_t i = 0; i < tree->root_count; ++i)
+    if (ast_kind(tree, tree->roots[i]) == A_FUNDEF)
+      functions[ast_name(tree, tree->roots[i])] =
+          (interpreter_function_t){tree, tree->roots[i], 0, false, false};
+  hoisted = true;
+
+  return interpreter_feed(&f, parser);
 }
 
-void _interpreter_execute(ast_node_t *node) {
+static void _interpreter_execute(ast_ref_t ref) {
+  if (walk_depth >= WALK_MAX_DEPTH) {
+    if (!stopped) fprintf(stderr, "Error: Nested too deep to walk\n");
+    stopped = true;
+    return;
+  }
+
+  walk_depth++;
+  _interpreter_walk(ref);
+  walk_depth--;
+}
+
+static void _interpreter_walk(ast_ref_t ref) {
   assert(A_LAST == 7 && "Implementation missing");
 
-  switch (node->kind) {
+  switch (ast_kind(ast, ref)) {
     case A_STRLIT:
       break;
 
     case A_MAIN: {
-      shput(functions, "main", node);
-      if (node->data.fundef.body) _interpreter_execute(node->data.fundef.body);
+      _interpreter_define(ast, ref, 0);
+      ast_ref_t body = ast_body(ast, ref);
+      if (body != AST_NIL) _interpreter_call(body, ast_slots(ast, ref));
     } break;
 
+    case A_FUNDEF:
+      _interpreter_define(ast, ref, 0);
+      break;
+
     case A_SCOPE: {
-      ast_node_da_t *stmts = &node->data.statements;
-      for (size_t i = 0; i < stmts->count; ++i)
-        _interpreter_execute(stmts->items[i]);
+      // A call may parse a lazy body and move the nodes, so the list is
+      // looked up again for every statement.
+      uint32_t count = ast_statements(ast, ref).count;
+      for (uint32_t i = 0; i < count && !stopped; ++i)
+        _interpreter_execute(ast_statements(ast, ref).items[i]);
     } break;
 
     case A_VAR_DECLARE: {
-      const char *name = node->data.vardeclare.name;
-      shput(variables, name, node->data.vardeclare.value);
+      uint32_t slot = ast_slot(ast, ref);
+      interpreter_value_t value = _interpreter_value(ast, ast_value(ast, ref));
+      if (slot == AST_GLOBAL) {
+        _interpreter_store_global(ast, ast_name(ast, ref), value);
+      } else {
+        assert(frame + slot < arrlenu(stack));
+        stack[frame + slot] = value;
+      }
     } break;
 
     case A_FUNCALL: {
-      const char *name = node->data.funcall.name;
-
-      if (strcmp(name, "printf") == 0) {
-        _builtin_printf(&node->data.funcall.args);
+      uint32_t target = ast_target(ast, ref);
+      if (target & AST_CALL_BUILTIN) {
+        // Arguments are passed as they are written, never run.
+        ast_list_t args = ast_args(ast, ref);
+        size_t none = 0;
+        arrsetlen(builtin_args, none);
+        for (uint32_t i = 0; i < args.count; ++i)
+          arrput(builtin_args, _interpreter_value(ast, args.items[i]));
+        builtins[target & ~AST_CALL_BUILTIN](ast, builtin_args, args.count);
         return;
       }
 
-      interpreter_functions_t *func = shgetp(functions, name);
-      if (func == NULL) {
-        fprintf(stderr, "Error: Undefined function '%s'\n", name);
-        return;
+      interpreter_function_t func = {ast, target, 0, true, false};
+      if (target == AST_NIL) {
+        sym_t name = ast_name(ast, ref);
+        func = _interpreter_function(name);
+        if (!func.ast) {
+          if (!stopped)
+            fprintf(stderr, "Error: Undefined function '%s'\n",
+                    intern_name(name));
+          return;
+        }
       }
 
-      if (func->value->data.fundef.body)
-        _interpreter_execute(func->value->data.fundef.body);
+      const ast_t *caller = ast;
+      ast = func.ast;
+      ast_ref_t body = _interpreter_body(ast, func.ref);
+      if (body != AST_NIL) _interpreter_call(body, ast_slots(ast, func.ref));
+      ast = caller;
     } break;
 
     default:
-      fprintf(stderr, "Error: Unknown AST node kind: %d\n", node->kind);
+      fprintf(stderr, "Error: Unknown AST node kind: %d\n", ast_kind(ast, ref));
       break;
   }
 }
 
-void _builtin_printf(ast_node_da_t *args) {
-  if (args->count < 1) return;
+// Bytecode. Every function is compiled to an array of 32-bit words on its
+// first call. A word holds an opcode in the low 8 bits and an operand above
+// them, like the header word of a node; a larger operand has its top 8 bits
+// in a WIDE word before it. Code works on the frame of its function: the
+// slots of the local variables, then a stack of operands that is empty
+// between statements.
+//
+//   HALT            ends a top level item
+//   RET             returns to the caller
+//   CONST k         pushes constant k of the function
+//   NIL             pushes a value that is not a literal
+//   STORE slot      pops into a local variable
+//   STORE_GLOBAL n  pops into the global variable of symbol n
+//   DEFINE f        registers function f under its name
+//   CALL f          calls function f
+//   CALL_NAME n     calls the function registered as symbol n
+//   BUILTIN b       calls builtin b with the argc values on top of the stack,
+//                   and pops them; argc is the next word
+//   BAD_NODE kind   reports a statement that cannot run
+//   WIDE hi         top 8 bits of the next operand
+//
+// There are no jumps, as the language has no control flow yet.
+#define VM_OPS(X)               \
+  X(HALT, halt)                 \
+  X(RET, ret)                   \
+  X(CONST, const)               \
+  X(NIL, nil)                   \
+  X(STORE, store)               \
+  X(STORE_GLOBAL, store_global) \
+  X(DEFINE, define)             \
+  X(CALL, call)                 \
+  X(CALL_NAME, call_name)       \
+  X(BUILTIN, builtin)           \
+  X(BAD_NODE, bad_node)         \
+  X(WIDE, wide)
+
+typedef enum vm_op {
+#define VM_OP(op, name) VM_##op,
+  VM_OPS(VM_OP)
+#undef VM_OP
+  VM_LAST
+} vm_op_t;
+
+static const char *const vm_op_names[VM_LAST] = {
+#define VM_OP_NAME(op, name) #name,
+    VM_OPS(VM_OP_NAME)
+#undef VM_OP_NAME
+};
+
+// Threaded dispatch: every handler jumps straight to the next one through a
+// table of label addresses, a GNU C extension, so each has its own indirect
+// branch to predict. Build with -DVM_SWITCH for a portable switch loop.
+#if defined(__GNUC__) && !defined(VM_SWITCH)
+#define VM_THREADED 1
+#endif
+
+#define VM_INSN(op, arg) ((uint32_t)(op) | (uint32_t)(arg) << 8)
+#define VM_ARG_MAX 0xffffffu
+
+// Calls nested deeper than this stop the run. Without control flow, only
+// endless recursion gets there.
+#define VM_MAX_DEPTH (1u << 20)
+
+typedef struct vm_function {
+  const ast_t *ast;
+  ast_ref_t ref;  // its A_MAIN or A_FUNDEF node
+  uint32_t slots;
+  uint32_t operands;  // most operands on its stack at once
+  uint32_t *code;  // NULL until it is compiled
+  interpreter_value_t *consts;
+} vm_function_t;
+
+// A caller to return to.
+typedef struct vm_frame {
+  uint32_t function;
+  uint32_t pc;
+  size_t frame;
+} vm_frame_t;
+
+// A literal of the function being compiled and its constant, current when
+// `pass` is that of the compilation.
+typedef struct vm_const {
+  ast_ref_t ref;
+  uint32_t k;
+  uint32_t pass;
+} vm_const_t;
+
+// Functions by index; entry 0 is the top level item being run.
+static vm_function_t *vm_functions;
+
+// The functions by node: open addressing table of indices into
+// `vm_functions`, 0 marks an empty slot.
+static uint32_t *vm_function_table;
+static size_t vm_function_capacity;
+
+static vm_frame_t *vm_frames;
+
+// Scratch space of the compiler: statements left to compile, next last, and
+// the literals of the function being compiled as an open addressing table.
+static ast_ref_t *vm_todo;
+static vm_const_t *vm_consts;
+static size_t vm_consts_capacity;
+static size_t vm_consts_count;
+static uint32_t vm_pass;
+
+// Ops run by opcode, counted when `vm_counting` is set, see
+// interpreter_stats().
+static bool vm_counting;
+static uint64_t vm_counts[VM_LAST];
+
+static uint32_t _vm_hash(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+static size_t _vm_function_slot(const ast_t *from, ast_ref_t ref) {
+  uint32_t h = _vm_hash(ref * 0x9e3779b1u ^ (uint32_t)((uintptr_t)from >> 4));
+  size_t mask = vm_function_capacity - 1, at = h & mask;
+  for (uint32_t f; (f = vm_function_table[at]) != 0; at = (at + 1) & mask)
+    if (vm_functions[f].ref == ref && vm_functions[f].ast == from) break;
+  return at;
+}
+
+// Index of the VM function of function `ref` of `from`. It is added
+// uncompiled when there is none yet.
+static uint32_t _vm_function(const ast_t *from, ast_ref_t ref) {
+  if (2 * arrlenu(vm_functions) >= vm_function_capacity) {
+    uint32_t *old = vm_function_table;
+    vm_function_capacity = vm_function_capacity ? 2 * vm_function_capacity : 64;
+    vm_function_table = calloc(vm_function_capacity, sizeof(uint32_t));
+    for (uint32_t f = 1; f < arrlenu(vm_functions); ++f)
+      vm_function_table[_vm_function_slot(vm_functions[f].ast,
+                                          vm_functions[f].ref)] = f;
+    free(old);
+  }
+
+  size_t at = _vm_function_slot(from, ref);
+  if (vm_function_table[at] != 0) return vm_function_table[at];
+
+  uint32_t index = (uint32_t)arrlenu(vm_functions);
+  vm_function_t f = {.ast = from, .ref = ref};
+  arrput(vm_functions, f);
+  vm_function_table[at] = index;
+  return index;
+}
+
+static size_t _vm_const_slot(ast_ref_t ref) {
+  size_t mask = vm_consts_capacity - 1, at = _vm_hash(ref * 0x9e3779b1u) & mask;
+  while (vm_consts[at].pass == vm_pass && vm_consts[at].ref != ref)
+    at = (at + 1) & mask;
+  return at;
+}
+
+// Constant of literal `ref` in the function being compiled, `k` when it has
+// none yet.
+static uint32_t _vm_const(ast_ref_t ref, uint32_t k) {
+  if (2 * (vm_consts_count + 1) > vm_consts_capacity) {
+    vm_const_t *old = vm_consts;
+    size_t old_capacity = vm_consts_capacity;
+    vm_consts_capacity = old_capacity ? 2 * old_capacity : 64;
+    vm_consts = calloc(vm_consts_capacity, sizeof(*vm_consts));
+    for (size_t i = 0; i < old_capacity; ++i)
+      if (old[i].pass == vm_pass)
+        vm_consts[_vm_const_slot(old[i].ref)] = old[i];
+    free(old);
+  }
 
-  ast_node_t *fmt_node = args->items[0];
-  if (fmt_node->kind != A_STRLIT) {
+  size_t at = _vm_const_slot(ref);
+  if (vm_consts[at].pass != vm_pass) {
+    vm_consts[at] = (vm_const_t){ref, k, vm_pass};
+    vm_consts_count++;
+  }
+  return vm_consts[at].k;
+}
+
+static void _vm_emit(uint32_t f, vm_op_t op, uint32_t arg) {
+  uint32_t **code = &vm_functions[f].code;
+  if (arg > VM_ARG_MAX) arrput(*code, VM_INSN(VM_WIDE, arg >> 24));
+  arrput(*code, VM_INSN(op, arg & VM_ARG_MAX));
+}
+
+// Pushes the value of `ref` as it is written.
+static void _vm_emit_value(uint32_t f, ast_ref_t ref) {
+  vm_function_t *fn = &vm_functions[f];
+  interpreter_value_t value = _interpreter_value(fn->ast, ref);
+  if (value.kind == A_LAST) {
+    _vm_emit(f, VM_NIL, 0);
+    return;
+  }
+
+  // Equal literals are one node, so they share a constant.
+  uint32_t k = _vm_const(ref, (uint32_t)arrlenu(fn->consts));
+  if (k == arrlenu(fn->consts)) arrput(fn->consts, value);
+  _vm_emit(f, VM_CONST, k);
+}
+
+// Appends the code of statement `root` to function `f`. Scopes may nest
+// deeply, so statements wait on `vm_todo` rather than the C stack.
+static void _vm_compile(uint32_t f, ast_ref_t root) {
+  assert(A_LAST == 7 && "Implementation missing");
+
+  const ast_t *from = vm_functions[f].ast;
+  if (root != AST_NIL) arrput(vm_todo, root);
+
+  // Entries of earlier passes count as empty.
+  vm_pass++;
+  vm_consts_count = 0;
+
+  while (arrlenu(vm_todo) > 0) {
+    ast_ref_t ref = arrpop(vm_todo);
+
+    switch (ast_kind(from, ref)) {
+      case A_STRLIT:
+        break;
+
+      case A_MAIN: {
+        uint32_t main_fn = _vm_function(from, ref);
+        _vm_emit(f, VM_DEFINE, main_fn);
+        _vm_emit(f, VM_CALL, main_fn);
+      } break;
+
+      case A_FUNDEF:
+        _vm_emit(f, VM_DEFINE, _vm_function(from, ref));
+        break;
+
+      case A_SCOPE: {
+        ast_list_t stmts = ast_statements(from, ref);
+        for (uint32_t i = stmts.count; i-- > 0;)
+          arrput(vm_todo, stmts.items[i]);
+      } break;
+
+      case A_VAR_DECLARE: {
+        uint32_t slot = ast_slot(from, ref);
+        _vm_emit_value(f, ast_value(from, ref));
+        if (vm_functions[f].operands < 1) vm_functions[f].operands = 1;
+        if (slot == AST_GLOBAL)
+          _vm_emit(f, VM_STORE_GLOBAL, ast_name(from, ref));
+        else
+          _vm_emit(f, VM_STORE, slot);
+      } break;
+
+      case A_FUNCALL: {
+        uint32_t target = ast_target(from, ref);
+        if (target & AST_CALL_BUILTIN) {
+          // Arguments are passed as they are written, never run.
+          ast_list_t args = ast_args(from, ref);
+          for (uint32_t i = 0; i < args.count; ++i)
+            _vm_emit_value(f, args.items[i]);
+          if (vm_functions[f].operands < args.count)
+            vm_functions[f].operands = args.count;
+          _vm_emit(f, VM_BUILTIN, target & ~AST_CALL_BUILTIN);
+          arrput(vm_functions[f].code, args.count);
+        } else if (target != AST_NIL) {
+          _vm_emit(f, VM_CALL, _vm_function(from, target));
+        } else {
+          _vm_emit(f, VM_CALL_NAME, ast_name(from, ref));
+        }
+      } break;
+
+      default:
+        _vm_emit(f, VM_BAD_NODE, ast_kind(from, ref));
+        break;
+    }
+  }
+}
+
+// Compiles function `f`, parsing its body first if a lazy parse skipped it.
+static void _vm_load(uint32_t f) {
+  const ast_t *from = vm_functions[f].ast;
+  ast_ref_t ref = vm_functions[f].ref;
+  ast_ref_t body = _interpreter_body(from, ref);
+
+  vm_functions[f].slots = ast_slots(from, ref);
+  _vm_compile(f, body);
+  _vm_emit(f, VM_RET, 0);
+}
+
+// Compiles top level item `ref` of `from` as function 0.
+static void _vm_load_item(const ast_t *from, ast_ref_t ref) {
+  if (!vm_functions) arrput(vm_functions, (vm_function_t){0});
+
+  vm_function_t *fn = &vm_functions[0];
+  size_t none = 0;
+  fn->ast = from;
+  fn->ref = ref;
+  fn->operands = 0;
+  arrsetlen(fn->code, none);
+  arrsetlen(fn->consts, none);
+
+  _vm_compile(0, ref);
+  _vm_emit(0, VM_HALT, 0);
+}
+
+// Makes room for the frame of `fn` from `at` on, and clears its slots.
+static void _vm_frame(const vm_function_t *fn, size_t at) {
+  interpreter_value_t nil = {A_LAST, 0};
+  size_t end = at + fn->slots + fn->operands;
+  if (arrlenu(stack) < end) arrsetlen(stack, end);
+  for (uint32_t i = 0; i < fn->slots; ++i) stack[at + i] = nil;
+}
+
+// Runs function 0 to its end. Frames are made large enough for their
+// operands on entry, so ops index the stack below `top` directly.
+static void _vm_run(void) {
+  interpreter_value_t nil = {A_LAST, 0};
+  size_t base = arrlenu(stack), top = base;
+  uint32_t f = 0, pc = 0, insn, op, arg;
+  const vm_function_t *fn = &vm_functions[f];
+  const uint32_t *code = fn->code;
+  frame = base;
+  _vm_frame(fn, base);
+
+#ifdef VM_THREADED
+  // Handlers by opcode, and stubs that count the op before going to them.
+  static const void *const handlers[VM_LAST] = {
+#define VM_HANDLER(op, name) &&vm_do_##op,
+      VM_OPS(VM_HANDLER)
+#undef VM_HANDLER
+  };
+  static const void *const counters[VM_LAST] = {
+#define VM_COUNTER(op, name) &&vm_count_##op,
+      VM_OPS(VM_COUNTER)
+#undef VM_COUNTER
+  };
+  const void *const *table = vm_counting ? counters : handlers;
+
+#define VM_CASE(op) \
+  case VM_##op:     \
+  vm_do_##op
+#define VM_NEXT()      \
+  insn = code[pc++];   \
+  op = insn & 0xff;    \
+  arg = insn >> 8;     \
+  goto *table[op]
+#else
+#define VM_CASE(op) case VM_##op
+#define VM_NEXT() continue
+#endif
+
+  // Only the first op goes through the switch with threaded dispatch.
+  for (;;) {
+    insn = code[pc++];
+    op = insn & 0xff;
+    arg = insn >> 8;
+
+  dispatch:
+    if (vm_counting) vm_counts[op]++;
+    switch (op) {
+      VM_CASE(HALT):
+        arrsetlen(stack, base);
+        return;
+
+      VM_CASE(RET): {
+        vm_frame_t caller = arrpop(vm_frames);
+        top = frame;
+        f = caller.function;
+        pc = caller.pc;
+        frame = caller.frame;
+        fn = &vm_functions[f];
+        code = fn->code;
+      }
+        VM_NEXT();
+
+      VM_CASE(CONST):
+        stack[top++] = fn->consts[arg];
+        VM_NEXT();
+
+      VM_CASE(NIL):
+        stack[top++] = nil;
+        VM_NEXT();
+
+      VM_CASE(STORE):
+        stack[frame + arg] = stack[--top];
+        VM_NEXT();
+
+      VM_CASE(STORE_GLOBAL):
+        _interpreter_store_global(fn->ast, arg, stack[--top]);
+        VM_NEXT();
+
+      VM_CASE(DEFINE):
+        _interpreter_define(fn->ast, vm_functions[arg].ref, arg);
+        VM_NEXT();
+
+      VM_CASE(CALL_NAME): {
+        interpreter_function_t callee = _interpreter_function(arg);
+        if (!callee.ast && stopped) goto call;
+        if (!callee.ast) {
+          fprintf(stderr, "Error: Undefined function '%s'\n",
+                  intern_name(arg));
+          VM_NEXT();
+        }
+        if (!callee.vm) {
+          callee.vm = _vm_function(callee.ast, callee.ref);
+          functions[arg].vm = callee.vm;
+        }
+        arg = callee.vm;
+      }
+        goto call;
+
+      VM_CASE(CALL):
+      call: {
+        if (!stopped && arrlenu(vm_frames) >= VM_MAX_DEPTH) {
+          fprintf(stderr, "Error: Calls nested too deep\n");
+          stopped = true;
+        }
+        if (!stopped && !vm_functions[arg].code) _vm_load(arg);
+        if (stopped) {
+          size_t none = 0;
+          arrsetlen(vm_frames, none);
+          arrsetlen(stack, base);
+          frame = base;
+          return;
+        }
+
+        vm_frame_t caller = {f, pc, frame};
+        arrput(vm_frames, caller);
+        f = arg;
+        pc = 0;
+        fn = &vm_functions[f];
+        code = fn->code;
+        frame = top;
+        top += fn->slots;
+        _vm_frame(fn, frame);
+      }
+        VM_NEXT();
+
+      VM_CASE(BUILTIN): {
+        uint32_t argc = code[pc++];
+        top -= argc;
+        builtins[arg](fn->ast, stack + top, argc);
+      }
+        VM_NEXT();
+
+      VM_CASE(BAD_NODE):
+        fprintf(stderr, "Error: Unknown AST node kind: %u\n", arg);
+        VM_NEXT();
+
+      VM_CASE(WIDE):
+        insn = code[pc++];
+        op = insn & 0xff;
+        arg = arg << 24 | insn >> 8;
+        goto dispatch;
+
+      default:
+        assert(0 && "unknown opcode");
+        return;
+    }
+  }
+
+#ifdef VM_THREADED
+#define VM_COUNT(op, name)   \
+  vm_count_##op:             \
+  vm_counts[VM_##op]++;      \
+  goto vm_do_##op;
+  VM_OPS(VM_COUNT)
+#undef VM_COUNT
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+static void _vm_item(interpreter_ref_t item) {
+  _vm_load_item(item.ast, item.ref);
+  _vm_run();
+}
+
+static void _vm_free(void) {
+  for (size_t i = 0; i < arrlenu(vm_functions); ++i) {
+    arrfree(vm_functions[i].code);
+    arrfree(vm_functions[i].consts);
+  }
+  arrfree(vm_functions);
+  free(vm_function_table);
+  vm_function_table = NULL;
+  vm_function_capacity = 0;
+  arrfree(vm_frames);
+  arrfree(vm_todo);
+  free(vm_consts);
+  vm_consts = NULL;
+  vm_consts_capacity = vm_consts_count = 0;
+  vm_pass = 0;
+}
+
+static void _vm_print_stats(void) {
+  if (!vm_counting) return;
+
+#ifdef VM_THREADED
+  const char *dispatch = "threaded";
+#else
+  const char *dispatch = "switch";
+#endif
+  uint64_t total = 0;
+  for (int op = 0; op < VM_LAST; ++op) total += vm_counts[op];
+
+  fprintf(stderr, "%-12s %14s %7s  (%s dispatch)\n", "op", "count", "share",
+          dispatch);
+  for (int op = 0; op < VM_LAST; ++op) {
+    if (vm_counts[op] == 0) continue;
+    fprintf(stderr, "%-12s %14llu %6.1f%%\n", vm_op_names[op],
+            (unsigned long long)vm_counts[op], 100.0 * vm_counts[op] / total);
+  }
+  fprintf(stderr, "%-12s %14llu\n", "total", (unsigned long long)total);
+  memset(vm_counts, 0, sizeof(vm_counts));
+}
+
+static void _vm_print_value(const ast_t *from, interpreter_value_t value) {
+  if (value.kind == A_I32) {
+    printf("%d", (int32_t)value.data);
+    return;
+  }
+
+  putchar('"');
+  for (const char *s = from->strings + value.data; *s; ++s) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\') printf("\\%c", c);
+    else if (c == '\n') printf("\\n");
+    else if (c == '\t') printf("\\t");
+    else if (c < ' ') printf("\\x%02x", c);
+    else putchar(c);
+  }
+  putchar('"');
+}
+
+static void _vm_print_function(uint32_t f) {
+  const vm_function_t *fn = &vm_functions[f];
+
+  for (uint32_t pc = 0; pc < arrlenu(fn->code);) {
+    uint32_t at = pc, insn = fn->code[pc++];
+    uint32_t op = insn & 0xff, arg = insn >> 8;
+    if (op == VM_WIDE) {
+      insn = fn->code[pc++];
+      op = insn & 0xff;
+      arg = arg << 24 | insn >> 8;
+    }
+
+    printf("%8u  %-12s", at, vm_op_names[op]);
+    switch (op) {
+      case VM_CONST:
+        printf(" %-8u ; ", arg);
+        _vm_print_value(fn->ast, fn->consts[arg]);
+        break;
+
+      case VM_STORE:
+      case VM_BAD_NODE:
+        printf(" %u", arg);
+        break;
+
+      case VM_STORE_GLOBAL:
+      case VM_CALL_NAME:
+        printf(" %s", intern_name(arg));
+        break;
+
+      case VM_DEFINE:
+      case VM_CALL: {
+        const vm_function_t *callee = &vm_functions[arg];
+        printf(" %-8u ; %s", arg,
+               intern_name(ast_name(callee->ast, callee->ref)));
+      } break;
+
+      case VM_BUILTIN:
+        printf(" %s %u", builtin_info[arg].name, fn->code[pc++]);
+        break;
+
+      default:
+        break;
+    }
+    putchar('\n');
+  }
+}
+
+void interpreter_stats(bool on) {
+  vm_counting = on;
+}
+
+void interpreter_dump(const ast_t *tree) {
+  for (uint32_t i = 0; i < tree->root_count; ++i) {
+    _vm_load_item(tree, tree->roots[i]);
+    printf("item %u:\n", i);
+    _vm_print_function(0);
+
+    // Functions the item refers to, and the ones they refer to in turn.
+    for (uint32_t f = 1; f < arrlenu(vm_functions); ++f) {
+      if (vm_functions[f].code) continue;
+      _vm_load(f);
+      const vm_function_t *fn = &vm_functions[f];
+      printf("function %u %s, %u slots:\n", f,
+             intern_name(ast_name(fn->ast, fn->ref)), fn->slots);
+      _vm_print_function(f);
+    }
+  }
+
+  _vm_free();
+}
+
+void _builtin_printf(const ast_t *ast, const interpreter_value_t *args,
+                     uint32_t argc) {
+  // The resolver checks the arity, but not every run is resolved.
+  if (argc < 1) {
+    fprintf(stderr, "Error: printf expects at least 1 argument\n");
+    return;
+  }
+  if (args[0].kind != A_STRLIT) {
     fprintf(stderr, "Error: printf expects string literal as first argument\n");
     return;
   }
-  printf("%s", fmt_node->data.str_val);
+  const char *s = ast->strings + args[0].data;
+  output_write(s, strlen(s));
+}
+
+void _builtin_flush(const ast_t *ast, const interpreter_value_t *args,
+                    uint32_t argc) {
+  (void)ast;
+  (void)args;
+  (void)argc;
+  if (output_flush() < 0) output_lost = true;
 }
@@ -1,18 +1,58 @@
 #ifndef INTERPRETER_H
 #define INTERPRETER_H
 
+#include <stdbool.h>
+
 #include "ast.h"
 
-typedef struct interpreter_functions {
-  char *key;
-  ast_node_t *value;
-} interpreter_functions_t;
+// Hands top level items to the interpreter one at a time, in input order.
+typedef struct interpreter_feed {
+  // Stores the next item in `*ast` and `*root`; false at the end of input.
+  bool (*next)(void *ctx, const ast_t **ast, ast_ref_t *root);
+
+  // Called once nothing refers to an item any more, or NULL. Items with
+  // definitions are released at the end of the run.
+  void (*release)(void *ctx, const ast_t *ast, ast_ref_t root);
+
+  // Whether the input ended early because it has errors, or NULL. Asked once
+  // `next` returned false; the run then stops where it is.
+  bool (*failed)(void *ctx);
+
+  void *ctx;
+} interpreter_feed_t;
+
+// Selects how code runs: "vm", the default, compiles every function to
+// bytecode on its first call and runs that; "walk" walks the AST. The walker
+// is kept for debugging and comparison only: it recurses, so nesting and
+// calls deeper than a fixed limit stop the run with an error. Returns -1
+// when `engine` is unknown.
+int interpreter_select(const char *engine);
+
+// Counts the ops the VM runs, and writes them by opcode to stderr at the end
+// of every run.
+void interpreter_stats(bool on);
+
+// Runs the top level items of `ast` in order. A function can be called
+// before its definition; with several definitions, a call uses the last one
+// run so far, or the last in `ast` when none ran yet. Function bodies
+// skipped by a lazy parse are parsed and resolved by `parser` on first call;
+// it may be NULL when the AST is complete. An error in such a body is
+// reported and stops the run, which then returns -1. Items must be resolved,
+// see resolve.h. Output of the program goes through output.h, and is flushed
+// before it returns; a failed write also returns -1.
+int interpreter_run(const ast_t *ast, parser_t *parser);
 
-typedef struct interpreter_variables {
-  char *key;
-  ast_node_t *value;
-} interpreter_variables_t;
+// Runs items as the feed produces them. An item calling a function that is
+// not defined yet reads ahead until the definition turns up, so the result is
+// the same as running the whole input at once. A definition read ahead
+// replaces an earlier one that did not run yet. When a call already ran an
+// earlier one, where the whole input would have run the later, the run stops
+// with an error and returns -1. So does reading ahead to the end of a feed
+// that failed.
+int interpreter_feed(interpreter_feed_t *feed, parser_t *parser);
 
-void interpreter_run(ast_node_da_t *list);
+// Writes the bytecode of every top level item of `ast`, and of the functions
+// they define or call, to stdout. `ast` must be complete and resolved.
+void interpreter_dump(const ast_t *ast);
 
 #endif /* ifndef INTERPRETER_H */
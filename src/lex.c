@@ -1,220 +1,592 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "lex.h"
+#include "scan.h"
 
-static void _ensure_capacity(lex_t *l, int needed) {
-  if (l->str_val_size + needed >= l->str_val_capacity) {
-    l->str_val_capacity *= 2;
-    l->str_val = realloc(l->str_val, l->str_val_capacity);
+static void _ensure_capacity(lex_token_t *t, size_t needed) {
+  if (t->str_val_size + needed >= t->str_val_capacity) {
+    if (t->str_val_capacity == 0) t->str_val_capacity = LEX_MAX_SYMBOL_LEN;
+    while (t->str_val_size + needed >= t->str_val_capacity)
+      t->str_val_capacity *= 2;
+    t->str_val = realloc(t->str_val, t->str_val_capacity);
   }
 }
 
-static inline int _fpeek(FILE *f) {
-    int ch = fgetc(f);
-    if (ch != EOF) ungetc(ch, f);
-    return ch;
+static int _lex_more(lex_t *l);
+
+static inline int _peek(lex_t *l) {
+  if (l->pos >= l->src_len && !_lex_more(l)) return EOF;
+  return (unsigned char)l->src[l->pos];
 }
 
-int lex_init(lex_t *l, const char *file_path) {
-  l->file_path = file_path;
-  l->str_val = malloc(LEX_MAX_SYMBOL_LEN);
-  if (!l->str_val) return -1;
-  l->str_val_capacity = LEX_MAX_SYMBOL_LEN;
+static inline int _getc(lex_t *l) {
+  if (l->pos >= l->src_len && !_lex_more(l)) return EOF;
+  return (unsigned char)l->src[l->pos++];
+}
+
+// Appends the start of every line beginning in window bytes [from, src_len).
+static int _index_lines(lex_t *l, size_t from) {
+  const char *p = l->src + from, *end = l->src + l->src_len;
+  size_t count = scan->count_byte(p, end, '\n');
+
+  if (l->line_count + count > l->line_capacity) {
+    size_t capacity = l->line_capacity ? l->line_capacity : 1024;
+    while (l->line_count + count > capacity) capacity *= 2;
+    uint32_t *grown = realloc(l->line_starts, capacity * sizeof(*grown));
+    if (!grown) return -1;
+    l->line_starts = grown;
+    l->line_capacity = capacity;
+  }
+
+  while (count--) {
+    p = scan->find_byte(p, end, '\n') + 1;
+    l->line_starts[l->line_count++] = l->base + (p - l->src);
+  }
+
+  return 0;
+}
+
+// Ends a streamed input early, recording why in `l->error`.
+static int _lex_fail(lex_t *l, const char *why) {
+  snprintf(l->error, sizeof(l->error), "Input ends early: %s", why);
+  if (l->fd != STDIN_FILENO) close(l->fd);
+  l->fd = -1;
+  return 0;
+}
+
+// Reads the next chunk of a streamed input into the window. Bytes before
+// `keep` are dropped first, so the window only grows past two chunks when a
+// single token is longer than a chunk. The line index keeps growing, see
+// lex_t.line_starts. Returns 0 once the input is exhausted.
+static int _lex_more(lex_t *l) {
+  if (l->fd < 0) return 0;
+
+  size_t drop = l->keep - l->base;
+  if (drop > 0) {
+    memmove(l->buf, l->buf + drop, l->src_len - drop);
+    l->base += drop;
+    l->src_len -= drop;
+    l->pos -= drop;
+  }
 
-  l->file = fopen(file_path, "r");
-  if (!l->file) return -1;
+  if (l->buf_capacity - l->src_len < LEX_CHUNK_SIZE) {
+    size_t capacity = l->buf_capacity * 2;
+    char *grown = realloc(l->buf, capacity);
+    if (!grown) return _lex_fail(l, "out of memory");
+    l->buf = grown;
+    l->buf_capacity = capacity;
+    l->src = grown;
+  }
+
+  ssize_t r;
+  do {
+    r = read(l->fd, l->buf + l->src_len, LEX_CHUNK_SIZE);
+  } while (r < 0 && errno == EINTR);
+
+  if (r < 0) return _lex_fail(l, strerror(errno));
 
+  // Token offsets are 32 bits wide.
+  if (r > 0 && l->base + l->src_len + r > UINT32_MAX)
+    return _lex_fail(l, "larger than 4 GB");
+
+  if (r == 0) {
+    if (l->fd != STDIN_FILENO) close(l->fd);
+    l->fd = -1;
+    return 0;
+  }
+
+  size_t from = l->src_len;
+  l->src_len += r;
+  _index_lines(l, from);
   return 1;
 }
 
-token_t lex_next(lex_t *l) {
-  assert(T_LAST == 261 && "Implementation missing");
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void _scan_default(void) {
+  if (!scan) scan_select(NULL);
+}
 
-  char ch = fgetc(l->file);
-  l->str_val_size = 0;
-  l->int_val = 0;
+// State every lexer needs, whatever its input.
+static int _lex_setup(lex_t *l, const char *file_path) {
+  pthread_once(&scan_once, _scan_default);
 
-  if (ch == EOF) return T_EOF;
+  l->file_path = file_path;
+  l->fd = -1;
+  l->syms = calloc(1, sizeof(*l->syms));
+  l->tok.str_val = malloc(LEX_MAX_SYMBOL_LEN);
+  if (!l->syms || !l->tok.str_val) return -1;
+  l->tok.str_val_capacity = LEX_MAX_SYMBOL_LEN;
+  return 0;
+}
 
-  // Skip whitespace
-  if (isspace(ch)) {
-    if (ch == '\n') {
-      l->line++;
-      l->col = 0;
-    } else {
-      l->col++;
-    }
+int lex_init(lex_t *l, const char *file_path) {
+  if (_lex_setup(l, file_path) < 0) return -1;
 
-    while ((ch = fgetc(l->file)) != EOF) {
-      if (ch == '\n') {
-        l->line++;
-        l->col = 0;
-      } else {
-        l->col++;
-      }
+  int fd;
+  if (strcmp(file_path, "-") == 0) {
+    l->file_path = "<stdin>";
+    fd = STDIN_FILENO;
+  } else {
+    fd = open(file_path, O_RDONLY);
+    if (fd < 0) return -1;
+  }
 
-      if (!isspace(ch)) break;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    if (fd != STDIN_FILENO) close(fd);
+    return -1;
+  }
+
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    // Token offsets are 32 bits wide.
+    if ((uint64_t)st.st_size > UINT32_MAX) {
+      if (fd != STDIN_FILENO) close(fd);
+      return -1;
     }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+      l->src = map;
+      l->src_len = st.st_size;
+      l->mapped = 1;
+      if (fd != STDIN_FILENO) close(fd);
+      return 1;
+    }
+  }
+
+  // Pipes, devices and anything else that cannot be mapped are streamed
+  // through a window of two chunks.
+  l->buf_capacity = 2 * LEX_CHUNK_SIZE;
+  l->buf = malloc(l->buf_capacity);
+  l->line_starts = malloc(1024 * sizeof(*l->line_starts));
+  if (!l->buf || !l->line_starts) {
+    if (fd != STDIN_FILENO) close(fd);
+    return -1;
+  }
+  l->src = l->buf;
+  l->fd = fd;
+  l->line_starts[0] = 0;
+  l->line_count = 1;
+  l->line_capacity = 1024;
+
+  return 1;
+}
+
+int lex_init_buffer(lex_t *l, const char *name, const char *src, size_t len) {
+  // Token offsets are 32 bits wide.
+  if ((uint64_t)len > UINT32_MAX) return -1;
+  if (_lex_setup(l, name) < 0) return -1;
+
+  l->src = src;
+  l->src_len = len;
+  return 1;
+}
+
+// Nothing before the current position is needed while skipping ahead of the
+// current token; lookahead must not drop the current token.
+static inline void _release(lex_t *l, int own) {
+  l->keep = own ? l->base + l->pos : l->tok.start;
+}
+
+// SWAR digit parsing works on 8 input bytes loaded into one little endian
+// word, first byte lowest.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LEX_SWAR 1
+#endif
+
+#ifdef LEX_SWAR
+static const uint64_t _pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000,
+                                  10000000, 100000000};
+
+// Number of leading bytes of `word` that are ASCII digits. Carries out of a
+// non-digit byte only disturb the bytes after it.
+static inline int _swar_digits(uint64_t word) {
+  uint64_t hi = 0xF0F0F0F0F0F0F0F0ull, threes = 0x3333333333333333ull;
+  uint64_t non = ((word & hi) ^ (threes & hi)) |
+                 (((word + 0x0606060606060606ull) & hi) ^ (threes & hi));
+  return non ? __builtin_ctzll(non) / 8 : 8;
+}
+
+// Value of 8 digit values 0-9, one per byte, first byte most significant.
+static inline uint32_t _swar_value(uint64_t v) {
+  v = v * 10 + (v >> 8);
+  v = ((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32)) +
+       ((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32))) >> 32;
+  return v;
+}
+#endif
+
+// Parses the integer literal at `p`: decimal, or hexadecimal and binary after
+// a 0x or 0b prefix, with '_' allowed between digits. Like a symbol, the
+// literal runs up to the first byte that cannot continue an identifier.
+// Stores LEX_INT_OVERFLOW or LEX_INT_INVALID in `value` when it does not fit
+// a long or is malformed, and returns the end of the literal.
+static const char *_lex_number(const char *p, const char *end, long *value) {
+  unsigned long v = 0;
+  int radix = 10, digits = 0, overflow = 0, invalid = 0;
+
+  if (end - p > 1 && p[0] == '0' && (p[1] | 0x20) == 'x') radix = 16;
+  if (end - p > 1 && p[0] == '0' && (p[1] | 0x20) == 'b') radix = 2;
+  if (radix != 10) p += 2;
+  const char *digits_start = p;
+
+#ifdef LEX_SWAR
+  // Up to eight decimal digits per step, until a separator or the end.
+  while (radix == 10 && end - p >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    int n = _swar_digits(word);
+    if (n == 0) break;
+
+    // Digit values of the n leading bytes, moved to the top so the bytes
+    // below read as leading zeros.
+    word = (word - 0x3030303030303030ull) << (8 * (8 - n));
+    overflow |= __builtin_mul_overflow(v, _pow10[n], &v);
+    overflow |= __builtin_add_overflow(v, _swar_value(word), &v);
+    digits += n;
+    p += n;
+    if (n < 8) break;
   }
+#endif
+
+  for (; p < end; ++p) {
+    int ch = (unsigned char)*p, d;
+    if (ch == '_') {
+      // Only single separators between digits.
+      if (p == digits_start || p[-1] == '_') invalid = 1;
+      continue;
+    }
+    if (isdigit(ch)) d = ch - '0';
+    else if (isalpha(ch)) d = (ch | 0x20) - 'a' + 10;
+    else break;
 
-  // Skip comments
-  if (ch == '/' && _fpeek(l->file) == '/') {
-    fgetc(l->file);
-    l->col += 2;
-    while ((ch = fgetc(l->file)) != EOF && ch != '\n') l->col++;
-    if (ch == '\n') {
-      l->line++;
-      l->col = 0;
+    if (d >= radix) {
+      invalid = 1;
+      continue;
     }
-    return lex_next(l);
+    overflow |= __builtin_mul_overflow(v, (unsigned long)radix, &v);
+    overflow |= __builtin_add_overflow(v, (unsigned long)d, &v);
+    digits++;
   }
-  else if (ch == '/' && _fpeek(l->file) == '*') {
-    fgetc(l->file);
-    l->col += 2;
-    while ((ch = fgetc(l->file)) != EOF) {
-      if (ch == '\n') {
-        l->line++;
-        l->col = 0;
+
+  if (p > digits_start && p[-1] == '_') invalid = 1;
+  if (invalid || digits == 0) *value = LEX_INT_INVALID;
+  else if (overflow || v > LONG_MAX) *value = LEX_INT_OVERFLOW;
+  else *value = v;
+
+  return p;
+}
+
+// _lex_scan() flags: decode string literals into `str_val`; only hash
+// symbols into `hash` instead of interning them.
+#define LEX_SCAN_DECODE 1
+#define LEX_SCAN_HASH 2
+
+static token_t _lex_scan(lex_t *l, lex_token_t *t, int flags) {
+  assert(T_LAST == 261 && "Implementation missing");
+
+  int own = t == &l->tok;
+  int ch;
+  t->str_val_size = 0;
+  t->int_val = 0;
+
+  for (;;) {
+    // Skip whitespace. Most runs are a single space, so look at the first
+    // byte before paying for a call into the scanner.
+    for (;;) {
+      const char *p = l->src + l->pos, *end = l->src + l->src_len;
+      if (p < end && !isspace((unsigned char)*p)) break;
+      l->pos = scan->skip_space(p, end) - l->src;
+      if (l->pos < l->src_len) break;
+      _release(l, own);
+      if (!_lex_more(l)) break;
+    }
+
+    t->start = l->base + l->pos;
+    l->keep = own ? t->start : l->tok.start;
+    ch = _getc(l);
+
+    if (ch != '/') break;
+
+    // Skip comments
+    int next = _peek(l);
+    if (next == '/') {
+      l->pos++;
+      for (;;) {
+        _release(l, own);
+        const char *end = l->src + l->src_len;
+        l->pos = scan->find_byte(l->src + l->pos, end, '\n') - l->src;
+        if (l->pos < l->src_len || !_lex_more(l)) break;
       }
-      if (ch == '*' && _fpeek(l->file) == '/') {
-        fgetc(l->file);
-        l->col++;
-        return lex_next(l);
+    } else if (next == '*') {
+      l->pos++;
+      for (;;) {
+        _release(l, own);
+        const char *end = l->src + l->src_len;
+        const char *close = scan->find_pair(l->src + l->pos, end, '*', '/');
+        if (close < end) {
+          l->pos = close - l->src + 2;
+          break;
+        }
+
+        // A trailing '*' may be closed by the next chunk.
+        l->pos = l->src_len;
+        if (l->pos > 0 && l->src[l->pos - 1] == '*') l->pos--;
+        if (!_lex_more(l)) {
+          l->pos = l->src_len;
+          break;
+        }
       }
-      l->col++;
+    } else {
+      break;
     }
-    return lex_next(l);
   }
 
+  t->len = 0;
+
+  if (ch == EOF) return T_EOF;
+
   // String literal
   if (ch == '"') {
-    l->col++;
-    while ((ch = fgetc(l->file)) != EOF) {
-      if (ch == '"') break;
-      l->col++;
-
-      if (ch == '\\') {
-        ch = fgetc(l->file);
-        l->col++;
-        switch (ch) {
-          case 'n':
-            ch = '\n';
-            break;
-          case 't':
-            ch = '\t';
-            break;
-          case 'r':
-            ch = '\r';
-            break;
-          case '\\':
-            ch = '\\';
-            break;
-          case '"':
-            ch = '"';
-            break;
-          default:
-            break;
-        }
+    uint32_t body = l->base + l->pos;
+    for (;;) {
+      const char *end = l->src + l->src_len;
+      const char *stop = scan->find_either(l->src + l->pos, end, '"', '\\');
+      l->pos = stop - l->src;
+      if (stop < end && *stop == '"') break;
+
+      // Skip the escaped byte, unless it is in the next chunk.
+      if (stop + 1 < end) {
+        l->pos += 2;
+        continue;
       }
-      _ensure_capacity(l, 1);
-      l->str_val[l->str_val_size++] = ch;
+      if (!_lex_more(l)) break;
+    }
+
+    uint32_t body_len = l->base + l->pos - body;
+    if (l->pos < l->src_len) l->pos++;
+    else l->pos = l->src_len;
+
+    t->len = l->base + l->pos - t->start;
+    t->int_val = body_len;
+
+    if (flags & LEX_SCAN_DECODE) {
+      _ensure_capacity(t, body_len + 1);
+      t->str_val_size = lex_unescape(lex_at(l, body), body_len, t->str_val);
+      t->str_val[t->str_val_size] = '\0';
     }
-    l->str_val[l->str_val_size] = '\0';
     return T_STRLIT;
   }
 
-  // Decimal Number literal
+  // Number literal
   if (isdigit(ch)) {
-    l->int_val = ch - '0';
-    l->col++;
-    while ((ch = fgetc(l->file)) != EOF) {
-      if (!isdigit(ch)) {
-        fseek(l->file, -1, SEEK_CUR);
-        l->col--;
-        break;
-      }
-      l->col++;
-      l->int_val *= 10;
-      l->int_val += ch - '0';
+    for (;;) {
+      const char *end = l->src + l->src_len;
+      const char *stop = _lex_number(lex_at(l, t->start), end, &t->int_val);
+      l->pos = stop - l->src;
+      if (stop < end || !_lex_more(l)) break;
     }
+    t->len = l->base + l->pos - t->start;
     return T_INTLIT;
   }
 
-  // TODO: Support Hexadecimal literals.
-
   // Operators/punctuation
   if (strchr("(){}[]<>.,;:=+-*/!&|", ch)) {
-    l->str_val[0] = ch;
-    l->str_val[1] = '\0';
-    l->str_val_size = 1;
+    t->len = 1;
     return ch;
   }
 
   // Symbol
   if (isalpha(ch) || ch == '_') {
-    while (ch != EOF && (isalnum(ch) || ch == '_')) {
-      _ensure_capacity(l, 1);
-      l->str_val[l->str_val_size++] = ch;
-      l->col++;
-      ch = fgetc(l->file);
+    uint32_t hash = intern_hash_step(INTERN_HASH_INIT, ch);
+    while ((ch = _peek(l)) != EOF && (isalnum(ch) || ch == '_')) {
+      hash = intern_hash_step(hash, ch);
+      l->pos++;
     }
+    t->len = l->base + l->pos - t->start;
+    t->hash = hash;
 
-    l->str_val[l->str_val_size] = '\0';
-    ungetc(ch, l->file);
+    if (flags & LEX_SCAN_HASH) {
+      if (t->len == 3 && memcmp(lex_at(l, t->start), "i32", 3) == 0)
+        return T_I32;
+      return T_SYMBOL;
+    }
 
-    if (strcmp(l->str_val, "i32") == 0) return T_I32;
+    t->sym = intern_cached(l->syms, lex_at(l, t->start), t->len, hash);
+    if (t->sym == SYM_I32) return T_I32;
 
     return T_SYMBOL;
   }
 
-  l->col++;
   return T_EOF;
 }
 
-token_t lex_peek(lex_t *l) {
-  fpos_t pos_bak;
-  int line_bak = l->line;
-  int col_bak = l->col;
+token_t lex_next(lex_t *l) {
+  if (l->ahead_count > 0) {
+    // Swap rather than copy, so the text buffers just change owners.
+    lex_token_t *next = &l->ahead[l->ahead_head];
+    lex_token_t tmp = l->tok;
+    l->tok = *next;
+    *next = tmp;
+    l->ahead_head = (l->ahead_head + 1) & (LEX_LOOKAHEAD - 1);
+    l->ahead_count--;
+    return l->tok.kind;
+  }
+
+  l->tok.kind = _lex_scan(l, &l->tok, LEX_SCAN_DECODE);
+  return l->tok.kind;
+}
+
+int lex_seek(lex_t *l, uint32_t offset) {
+  if (offset < l->base || offset > l->base + l->src_len) return -1;
+  l->pos = offset - l->base;
+  l->ahead_count = 0;
+  return 0;
+}
+
+const lex_token_t *lex_lookahead(lex_t *l, size_t n) {
+  assert(n >= 1 && n <= LEX_LOOKAHEAD && "Lookahead out of range");
+
+  while (l->ahead_count < n) {
+    size_t slot = (l->ahead_head + l->ahead_count) & (LEX_LOOKAHEAD - 1);
+    lex_token_t *t = &l->ahead[slot];
+    t->kind = _lex_scan(l, t, LEX_SCAN_DECODE);
+    l->ahead_count++;
+  }
+
+  return &l->ahead[(l->ahead_head + n - 1) & (LEX_LOOKAHEAD - 1)];
+}
+
+token_t lex_peek_nth(lex_t *l, size_t n) { return lex_lookahead(l, n)->kind; }
+
+token_t lex_peek(lex_t *l) { return lex_peek_nth(l, 1); }
+
+size_t lex_unescape(const char *raw, size_t len, char *out) {
+  const char *p = raw, *end = raw + len;
+  size_t n = 0;
 
-  char *str_val_bak = NULL;
-  size_t str_val_size_bak = l->str_val_size;
+  while (p < end) {
+    const char *esc = scan->find_byte(p, end, '\\');
+    memcpy(out + n, p, esc - p);
+    n += esc - p;
+    if (esc + 1 >= end) break;
 
-  if (l->str_val_size > 0) {
-    str_val_bak =  malloc(l->str_val_capacity);
-    if (str_val_bak) strncpy(str_val_bak, l->str_val, l->str_val_size);
+    char ch = esc[1];
+    switch (ch) {
+      case 'n':
+        ch = '\n';
+        break;
+      case 't':
+        ch = '\t';
+        break;
+      case 'r':
+        ch = '\r';
+        break;
+      case '\\':
+        ch = '\\';
+        break;
+      case '"':
+        ch = '"';
+        break;
+      default:
+        break;
+    }
+    out[n++] = ch;
+    p = esc + 2;
   }
 
-  fgetpos(l->file, &pos_bak);
-  token_t token = lex_next(l);
+  return n;
+}
+
+const char *lex_text(lex_t *l, size_t *len) {
+  *len = l->tok.len;
+  return lex_at(l, l->tok.start);
+}
+
+char *lex_str(lex_t *l) {
+  lex_token_t *t = &l->tok;
+  t->str_val_size = 0;
+  _ensure_capacity(t, t->len + 1);
+  memcpy(t->str_val, lex_at(l, t->start), t->len);
+  t->str_val_size = t->len;
+  t->str_val[t->str_val_size] = '\0';
+  return t->str_val;
+}
+
+// Offsets of the first byte of every line. Only diagnostics need line and
+// column numbers, so the index is built the first time one is asked for.
+// Streamed inputs are indexed chunk by chunk as they are read.
+static int _build_line_index(lex_t *l) {
+  l->line_starts = malloc(sizeof(*l->line_starts));
+  if (!l->line_starts) return -1;
+  l->line_starts[0] = 0;
+  l->line_count = l->line_capacity = 1;
+  return _index_lines(l, 0);
+}
 
-  l->line = line_bak;
-  l->col = col_bak;
-  fsetpos(l->file, &pos_bak);
+void lex_position(lex_t *l, uint32_t offset, int *line, int *col) {
+  *line = *col = 0;
+  if (!l->line_starts && _build_line_index(l) < 0) return;
 
-  if (str_val_bak) {
-    strncpy(l->str_val, str_val_bak, str_val_size_bak);
-    l->str_val_size = str_val_size_bak;
+  // Last line starting at or before `offset`.
+  size_t lo = 0, hi = l->line_count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (l->line_starts[mid] <= offset) lo = mid;
+    else hi = mid;
   }
 
-  return token;
+  *line = lo + 1;
+  *col = offset - l->line_starts[lo] + 1;
 }
 
-void lex_report_err(lex_t *lexer, const char *fmt, ...) {
-  va_list args;
+static void _vreport(lex_t *lexer, uint32_t offset, const char *severity,
+                     const char *fmt, va_list args) {
+  FILE *out = lexer->diag ? lexer->diag : stderr;
+  int line, col;
+
+  lex_position(lexer, offset, &line, &col);
+  fprintf(out, "%s:%d:%d: %s: ",
+          lexer->file_path ? lexer->file_path : "<unknown>", line, col,
+          severity);
+  vfprintf(out, fmt, args);
+  fprintf(out, "\n");
+}
 
-  fprintf(stderr, "%s:%d:%d: error: ",
-          lexer->file_path ? lexer->file_path : "<unknown>", lexer->line,
-          lexer->col);
+void lex_report_err_at(lex_t *lexer, uint32_t offset, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  _vreport(lexer, offset, "error", fmt, args);
+  va_end(args);
+}
 
+void lex_report_err(lex_t *lexer, const char *fmt, ...) {
+  va_list args;
   va_start(args, fmt);
-  vfprintf(stderr, fmt, args);
+  _vreport(lexer, lexer->tok.start, "error", fmt, args);
   va_end(args);
+}
 
-  fprintf(stderr, "\n");
+void lex_report_warn_at(lex_t *lexer, uint32_t offset, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  _vreport(lexer, offset, "warning", fmt, args);
+  va_end(args);
 }
 
 void lex_kind_label(lex_t *l, token_t t, char *buf) {
@@ -230,13 +602,21 @@ void lex_kind_label(lex_t *l, token_t t, char *buf) {
       sprintf(buf, "T_EOF");
       break;
     case T_SYMBOL:
-      sprintf(buf, "T_SYMBOL(%.*s)", (int)l->str_val_size, l->str_val);
+      sprintf(buf, "T_SYMBOL(%.*s)", LEX_LABEL_TEXT, intern_name(l->tok.sym));
       break;
     case T_STRLIT:
-      sprintf(buf, "T_STRLIT(%.*s)", (int)l->str_val_size, l->str_val);
+      sprintf(buf, "T_STRLIT(%.*s)",
+              (int)(l->tok.str_val_size < LEX_LABEL_TEXT ? l->tok.str_val_size
+                                                         : LEX_LABEL_TEXT),
+              l->tok.str_val);
       break;
     case T_INTLIT:
-      sprintf(buf, "T_INTLIT(%ld)", l->int_val);
+      if (l->tok.int_val == LEX_INT_OVERFLOW)
+        sprintf(buf, "T_INTLIT(overflow)");
+      else if (l->tok.int_val == LEX_INT_INVALID)
+        sprintf(buf, "T_INTLIT(invalid)");
+      else
+        sprintf(buf, "T_INTLIT(%ld)", l->tok.int_val);
       break;
     case T_LAST:
       sprintf(buf, "T_LAST");
@@ -250,4 +630,577 @@ void lex_kind_label(lex_t *l, token_t t, char *buf) {
   }
 }
 
-void lex_free(lex_t *l) { free(l->str_val); }
+void lex_free(lex_t *l) {
+  free(l->syms);
+  l->syms = NULL;
+  free(l->tok.str_val);
+  for (size_t i = 0; i < LEX_LOOKAHEAD; ++i) free(l->ahead[i].str_val);
+  free(l->line_starts);
+  l->line_starts = NULL;
+  if (l->mapped) munmap((void *)l->src, l->src_len);
+  free(l->buf);
+  if (l->fd >= 0 && l->fd != STDIN_FILENO) close(l->fd);
+  l->src = l->buf = NULL;
+}
+
+static int _stream_grow(lex_stream_t *ts) {
+  size_t capacity = ts->capacity ? ts->capacity * 2 : 1024;
+  uint8_t *kinds = realloc(ts->kinds, capacity * sizeof(*kinds));
+  if (kinds) ts->kinds = kinds;
+  uint32_t *starts = realloc(ts->starts, capacity * sizeof(*starts));
+  if (starts) ts->starts = starts;
+  uint32_t *lens = realloc(ts->lens, capacity * sizeof(*lens));
+  if (lens) ts->lens = lens;
+  int64_t *values = realloc(ts->values, capacity * sizeof(*values));
+  if (values) ts->values = values;
+
+  if (!kinds || !starts || !lens || !values) return -1;
+  ts->capacity = capacity;
+  return 0;
+}
+
+int lex_stream_init(lex_stream_t *ts, lex_t *l) {
+  assert(T_LAST - T_EOF < 128 && "Token kinds do not fit in a byte");
+
+  // The parser reads string literals back from the input, so a streamed
+  // input is read in full first.
+  l->keep = l->base;
+  while (_lex_more(l)) continue;
+
+  lex_token_t t = {0};
+  token_t kind;
+  do {
+    if (ts->count == ts->capacity && _stream_grow(ts) < 0) return -1;
+
+    kind = _lex_scan(l, &t, 0);
+    ts->kinds[ts->count] = lex_kind_pack(kind);
+    ts->starts[ts->count] = t.start;
+    ts->lens[ts->count] = t.len;
+    ts->values[ts->count] = kind == T_SYMBOL ? (int64_t)t.sym : t.int_val;
+    ts->count++;
+  } while (kind != T_EOF);
+
+  return 1;
+}
+
+static inline uint32_t _stream_end(const lex_stream_t *ts, size_t i) {
+  return ts->starts[i] + ts->lens[i];
+}
+
+int lex_stream_update(lex_stream_t *ts, lex_t *l, const lex_edit_t *edit) {
+  l->keep = l->base;
+  while (_lex_more(l)) continue;
+
+  // A token only depends on its own bytes and the one after it, so tokens
+  // ending before the edit stay, and lexing resumes at the end of the last
+  // of them. The final T_EOF always goes.
+  size_t lo = 0, hi = ts->count - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (_stream_end(ts, mid) < edit->start) lo = mid + 1;
+    else hi = mid;
+  }
+  size_t first = lo;
+  uint32_t from = first > 0 ? _stream_end(ts, first - 1) : 0;
+
+  // Lex the new input until a token ends, past the edit, where an old token
+  // ended. Both streams are then at the same place in the same text.
+  int64_t delta = (int64_t)edit->inserted - edit->removed;
+  uint32_t edit_end = edit->start + edit->inserted;
+  size_t old = first, keep = ts->count;
+  lex_stream_t fresh = {0};
+  lex_token_t t = {0};
+  int ret = 1;
+
+  l->pos = from - l->base;
+  for (;;) {
+    uint32_t at = l->base + l->pos;
+    if (at >= edit_end) {
+      uint32_t old_at = at - delta;
+      while (old < ts->count - 1 && _stream_end(ts, old) < old_at) old++;
+      if (old < ts->count - 1 && _stream_end(ts, old) == old_at) {
+        keep = old + 1;
+        break;
+      }
+    }
+
+    if (fresh.count == fresh.capacity && _stream_grow(&fresh) < 0) {
+      ret = -1;
+      break;
+    }
+
+    token_t kind = _lex_scan(l, &t, 0);
+    fresh.kinds[fresh.count] = lex_kind_pack(kind);
+    fresh.starts[fresh.count] = t.start;
+    fresh.lens[fresh.count] = t.len;
+    fresh.values[fresh.count] = kind == T_SYMBOL ? (int64_t)t.sym : t.int_val;
+    fresh.count++;
+    if (kind == T_EOF) break;
+  }
+
+  // Splice: old tokens [first, keep) make room for the fresh ones, and the
+  // ones after move by the size of the edit.
+  size_t tail = ts->count - keep, count = first + fresh.count + tail;
+  while (ret > 0 && ts->capacity < count)
+    if (_stream_grow(ts) < 0) ret = -1;
+
+  if (ret > 0) {
+    size_t to = first + fresh.count;
+    memmove(ts->kinds + to, ts->kinds + keep, tail * sizeof(*ts->kinds));
+    memmove(ts->lens + to, ts->lens + keep, tail * sizeof(*ts->lens));
+    memmove(ts->values + to, ts->values + keep, tail * sizeof(*ts->values));
+
+    // Move and shift the offsets in one pass, in the direction memmove would.
+    if (to > keep) {
+      for (size_t i = tail; i-- > 0;)
+        ts->starts[to + i] = ts->starts[keep + i] + delta;
+    } else {
+      for (size_t i = 0; i < tail; ++i)
+        ts->starts[to + i] = ts->starts[keep + i] + delta;
+    }
+
+    if (fresh.count > 0) {
+      size_t n = fresh.count;
+      memcpy(ts->kinds + first, fresh.kinds, n * sizeof(*ts->kinds));
+      memcpy(ts->starts + first, fresh.starts, n * sizeof(*ts->starts));
+      memcpy(ts->lens + first, fresh.lens, n * sizeof(*ts->lens));
+      memcpy(ts->values + first, fresh.values, n * sizeof(*ts->values));
+    }
+    ts->count = count;
+  }
+
+  lex_stream_free(&fresh);
+  return ret;
+}
+
+// Parallel lexing. The input is cut after newlines into chunks. Only string
+// literals and block comments span lines, so a chunk can only begin in one of
+// three states. Each chunk is lexed from every state on its own thread: the
+// normal run to the end of the chunk, the others until they reach one of the
+// normal run's token ends, from where both runs lex the same tokens. Walking
+// the chunks in order then tells which run each one really continues with.
+
+// Smallest chunk worth its own thread.
+#ifndef LEX_PARALLEL_MIN_CHUNK
+#define LEX_PARALLEL_MIN_CHUNK (256 * 1024)
+#endif
+
+// Tokens a string or comment run may lex speculatively before giving up on
+// meeting the normal run. It is finished later if the chunk turns out to
+// start in that state.
+#define LEX_SPECULATE_TOKENS 1024
+
+enum { AT_NORMAL, AT_STRING, AT_COMMENT, AT_STATES };
+
+#define UNMAPPED UINT32_MAX
+
+typedef struct lex_local_sym {
+  uint32_t start;
+  uint32_t len;
+  uint32_t hash;
+} lex_local_sym_t;
+
+// Symbols of one run, numbered in order of first appearance, so that runs can
+// be lexed without touching the global intern table.
+typedef struct lex_symtab {
+  uint32_t *slots;  // local id + 1; 0 marks an empty slot
+  size_t slots_capacity;
+  lex_local_sym_t *syms;
+  size_t count;
+  size_t capacity;
+} lex_symtab_t;
+
+typedef struct lex_run {
+  lex_stream_t toks;  // T_SYMBOL values are local ids
+  lex_symtab_t syms;
+  sym_t *map;         // local id to global id
+  size_t pos;         // window offset lexing resumes from
+  size_t cursor;      // first token of the normal run not yet passed
+  size_t join;        // first normal run token that follows, or SIZE_MAX
+  int exit;           // state at the end of the chunk
+  int done;
+  int eof;
+  int failed;
+} lex_run_t;
+
+typedef struct lex_chunk {
+  lex_t *l;
+  size_t index;
+  size_t start, end;  // window offsets
+  lex_run_t runs[AT_STATES];
+  lex_run_t *used;
+  lex_stream_t *out;
+  size_t out_at;
+} lex_chunk_t;
+
+static int _symtab_rehash(lex_symtab_t *tab) {
+  size_t capacity = tab->slots_capacity ? tab->slots_capacity * 2 : 256;
+  uint32_t *slots = calloc(capacity, sizeof(*slots));
+  if (!slots) return -1;
+
+  for (size_t i = 0; i < tab->count; ++i) {
+    size_t at = tab->syms[i].hash & (capacity - 1);
+    while (slots[at]) at = (at + 1) & (capacity - 1);
+    slots[at] = i + 1;
+  }
+
+  free(tab->slots);
+  tab->slots = slots;
+  tab->slots_capacity = capacity;
+  return 0;
+}
+
+static int64_t _symtab_add(lex_symtab_t *tab, const lex_t *l,
+                           const lex_token_t *t) {
+  if (tab->count * 2 >= tab->slots_capacity && _symtab_rehash(tab) < 0)
+    return -1;
+
+  size_t at = t->hash & (tab->slots_capacity - 1);
+  while (tab->slots[at]) {
+    lex_local_sym_t *s = &tab->syms[tab->slots[at] - 1];
+    if (s->hash == t->hash && s->len == t->len &&
+        memcmp(lex_at(l, s->start), lex_at(l, t->start), t->len) == 0)
+      return tab->slots[at] - 1;
+    at = (at + 1) & (tab->slots_capacity - 1);
+  }
+
+  if (tab->count == tab->capacity) {
+    size_t capacity = tab->capacity ? tab->capacity * 2 : 256;
+    lex_local_sym_t *grown = realloc(tab->syms, capacity * sizeof(*grown));
+    if (!grown) return -1;
+    tab->syms = grown;
+    tab->capacity = capacity;
+  }
+
+  lex_local_sym_t *s = &tab->syms[tab->count];
+  s->start = t->start;
+  s->len = t->len;
+  s->hash = t->hash;
+  tab->slots[at] = ++tab->count;
+  return tab->count - 1;
+}
+
+static int _run_push(lex_run_t *r, const lex_t *l, const lex_token_t *t,
+                     token_t kind) {
+  lex_stream_t *ts = &r->toks;
+  int64_t value = t->int_val;
+
+  if (kind == T_SYMBOL && (value = _symtab_add(&r->syms, l, t)) < 0) return -1;
+  if (ts->count == ts->capacity && _stream_grow(ts) < 0) return -1;
+
+  ts->kinds[ts->count] = lex_kind_pack(kind);
+  ts->starts[ts->count] = t->start;
+  ts->lens[ts->count] = t->len;
+  ts->values[ts->count] = value;
+  ts->count++;
+  return 0;
+}
+
+// State at window offset `to` of an input that has nothing but whitespace
+// and comments from `from` on, where no comment is open yet.
+static int _gap_state(const char *src, size_t from, size_t to) {
+  const char *p = src + from, *end = src + to;
+
+  for (;;) {
+    p = scan->skip_space(p, end);
+    if (end - p < 2 || p[0] != '/') return AT_NORMAL;
+
+    if (p[1] == '/') {
+      p = scan->find_byte(p + 2, end, '\n');
+    } else if (p[1] == '*') {
+      const char *close = scan->find_pair(p + 2, end, '*', '/');
+      if (close >= end) return AT_COMMENT;
+      p = close + 2;
+    } else {
+      return AT_NORMAL;
+    }
+  }
+}
+
+// A lexer over the same input that never reads more of it.
+static void _chunk_lexer(const lex_chunk_t *c, lex_t *sub) {
+  memset(sub, 0, sizeof(*sub));
+  sub->file_path = c->l->file_path;
+  sub->src = c->l->src;
+  sub->src_len = c->l->src_len;
+  sub->base = c->l->base;
+  sub->fd = -1;
+}
+
+// Positions run `r` at the start of its chunk, past the rest of the string
+// literal or block comment the chunk begins in, if any.
+static void _run_start(lex_run_t *r, const lex_chunk_t *c, int state) {
+  const char *src = c->l->src, *stop = src + c->l->src_len;
+  const char *p = src + c->start;
+
+  r->join = SIZE_MAX;
+  r->exit = state;
+
+  if (state == AT_STRING) {
+    for (;;) {
+      p = scan->find_either(p, stop, '"', '\\');
+      if (p >= stop || *p == '"') break;
+      p = p + 2 < stop ? p + 2 : stop;
+    }
+    p = p < stop ? p + 1 : stop;
+  } else if (state == AT_COMMENT) {
+    const char *close = scan->find_pair(p, stop, '*', '/');
+    p = close < stop ? close + 2 : stop;
+  }
+
+  r->pos = p - src;
+  if (r->pos > c->end) r->done = 1;
+}
+
+// Lexes run `r` until the end of its chunk, T_EOF, or `budget` tokens. Runs
+// other than the normal one also stop as soon as they meet it.
+static void _run_lex(lex_run_t *r, lex_chunk_t *c, size_t budget) {
+  const lex_run_t *n = r != &c->runs[AT_NORMAL] ? &c->runs[AT_NORMAL] : NULL;
+  lex_token_t t = {0};
+  lex_t sub;
+
+  _chunk_lexer(c, &sub);
+  sub.pos = r->pos;
+
+  for (; budget > 0; --budget) {
+    if (n) {
+      // The final T_EOF ends where it starts, not between two tokens.
+      uint32_t at = sub.base + sub.pos;
+      const lex_stream_t *nt = &n->toks;
+      size_t ends = nt->count - n->eof;
+      while (r->cursor < ends &&
+             nt->starts[r->cursor] + nt->lens[r->cursor] < at)
+        r->cursor++;
+      if (r->cursor < ends &&
+          nt->starts[r->cursor] + nt->lens[r->cursor] == at) {
+        r->join = r->cursor + 1;
+        r->done = 1;
+        return;
+      }
+    }
+
+    size_t before = sub.pos;
+    token_t kind = _lex_scan(&sub, &t, LEX_SCAN_HASH);
+    size_t start = t.start - sub.base;
+
+    if (kind == T_EOF && (start < c->end || c->end == sub.src_len)) {
+      r->failed |= _run_push(r, &sub, &t, kind) < 0;
+      r->eof = r->done = 1;
+      return;
+    }
+
+    if (start >= c->end) {
+      // Only a string literal can run from a token into the next chunk.
+      r->exit = before > c->end ? AT_STRING
+                                : _gap_state(sub.src, before, c->end);
+      r->done = 1;
+      return;
+    }
+
+    if (_run_push(r, &sub, &t, kind) < 0) {
+      r->failed = r->done = 1;
+      return;
+    }
+  }
+
+  r->pos = sub.pos;
+}
+
+static void *_chunk_lex(void *arg) {
+  lex_chunk_t *c = arg;
+
+  _run_start(&c->runs[AT_NORMAL], c, AT_NORMAL);
+  _run_lex(&c->runs[AT_NORMAL], c, SIZE_MAX);
+
+  if (c->index > 0) {
+    for (int state = AT_STRING; state < AT_STATES; ++state) {
+      lex_run_t *r = &c->runs[state];
+      _run_start(r, c, state);
+      if (!r->done) _run_lex(r, c, LEX_SPECULATE_TOKENS);
+    }
+  }
+
+  return NULL;
+}
+
+// Maps the local ids of `r` to global ones. Ids are handed out in order of
+// first appearance, the way a sequential run interns them.
+static int _run_map(lex_run_t *r, const lex_t *l, size_t from, int whole) {
+  if (!r->map) {
+    r->map = malloc((r->syms.count + 1) * sizeof(*r->map));
+    if (!r->map) return -1;
+    for (size_t i = 0; i < r->syms.count; ++i) r->map[i] = UNMAPPED;
+  }
+
+  if (whole) {
+    for (size_t i = 0; i < r->syms.count; ++i) {
+      lex_local_sym_t *s = &r->syms.syms[i];
+      r->map[i] = intern_hashed(lex_at(l, s->start), s->len, s->hash);
+    }
+    return 0;
+  }
+
+  const lex_stream_t *ts = &r->toks;
+  for (size_t i = from; i < ts->count; ++i) {
+    if (ts->kinds[i] != lex_kind_pack(T_SYMBOL)) continue;
+    sym_t local = ts->values[i];
+    if (r->map[local] != UNMAPPED) continue;
+    lex_local_sym_t *s = &r->syms.syms[local];
+    r->map[local] = intern_hashed(lex_at(l, s->start), s->len, s->hash);
+  }
+  return 0;
+}
+
+static void _run_copy(lex_stream_t *out, size_t at, const lex_run_t *r,
+                      size_t from) {
+  const lex_stream_t *ts = &r->toks;
+  size_t n = ts->count - from;
+  if (n == 0) return;
+
+  memcpy(out->kinds + at, ts->kinds + from, n * sizeof(*ts->kinds));
+  memcpy(out->starts + at, ts->starts + from, n * sizeof(*ts->starts));
+  memcpy(out->lens + at, ts->lens + from, n * sizeof(*ts->lens));
+  for (size_t i = 0; i < n; ++i) {
+    int64_t value = ts->values[from + i];
+    if (ts->kinds[from + i] == lex_kind_pack(T_SYMBOL)) value = r->map[value];
+    out->values[at + i] = value;
+  }
+}
+
+static void *_chunk_copy(void *arg) {
+  lex_chunk_t *c = arg;
+  lex_run_t *r = c->used, *n = &c->runs[AT_NORMAL];
+
+  _run_copy(c->out, c->out_at, r, 0);
+  if (r->join != SIZE_MAX)
+    _run_copy(c->out, c->out_at + r->toks.count, n, r->join);
+  return NULL;
+}
+
+// Runs `fn` on every chunk, the first one on the calling thread.
+static void _chunks_each(lex_chunk_t *chunks, size_t count,
+                         void *(*fn)(void *)) {
+  pthread_t *threads = malloc(count * sizeof(*threads));
+  int *started = calloc(count, sizeof(*started));
+
+  for (size_t i = 1; i < count; ++i)
+    if (threads && started)
+      started[i] = pthread_create(&threads[i], NULL, fn, &chunks[i]) == 0;
+
+  fn(&chunks[0]);
+
+  for (size_t i = 1; i < count; ++i) {
+    if (started && started[i]) pthread_join(threads[i], NULL);
+    else fn(&chunks[i]);
+  }
+
+  free(threads);
+  free(started);
+}
+
+static void _run_free(lex_run_t *r) {
+  lex_stream_free(&r->toks);
+  free(r->syms.slots);
+  free(r->syms.syms);
+  free(r->map);
+}
+
+int lex_stream_init_parallel(lex_stream_t *ts, lex_t *l, size_t threads) {
+  l->keep = l->base;
+  while (_lex_more(l)) continue;
+
+  size_t from = l->pos, len = l->src_len - from;
+  if (threads > len / LEX_PARALLEL_MIN_CHUNK)
+    threads = len / LEX_PARALLEL_MIN_CHUNK;
+  if (threads < 2) return lex_stream_init(ts, l);
+
+  lex_chunk_t *chunks = calloc(threads, sizeof(*chunks));
+  if (!chunks) return -1;
+
+  size_t count = 0;
+  for (size_t start = from; start < l->src_len; ++count) {
+    lex_chunk_t *c = &chunks[count];
+    c->l = l;
+    c->index = count;
+    c->start = start;
+    c->end = l->src_len;
+
+    size_t target = from + len / threads * (count + 1);
+    if (count + 1 < threads && target > start) {
+      const char *end = l->src + l->src_len;
+      const char *nl = scan->find_byte(l->src + target, end, '\n');
+      if (nl < end) c->end = nl + 1 - l->src;
+    }
+    start = c->end;
+  }
+
+  _chunks_each(chunks, count, _chunk_lex);
+
+  // Follow the real state from chunk to chunk.
+  int ret = 1, state = AT_NORMAL;
+  size_t total = 0, used = 0;
+  while (used < count) {
+    lex_chunk_t *c = &chunks[used++];
+    lex_run_t *r = &c->runs[state], *n = &c->runs[AT_NORMAL];
+    if (!r->done) _run_lex(r, c, SIZE_MAX);
+
+    int joined = r->join != SIZE_MAX;
+    if (r->failed || (joined && n->failed) ||
+        _run_map(r, l, 0, r == n) < 0 ||
+        (joined && _run_map(n, l, r->join, 0) < 0)) {
+      ret = -1;
+      break;
+    }
+
+    c->used = r;
+    c->out = ts;
+    c->out_at = total;
+    total += r->toks.count + (joined ? n->toks.count - r->join : 0);
+
+    if (joined ? n->eof : r->eof) break;
+    state = joined ? n->exit : r->exit;
+  }
+
+  if (ret > 0) {
+    assert(total > 0 && "Parallel lexing lost the final T_EOF");
+    while (ret > 0 && ts->capacity < ts->count + total)
+      if (_stream_grow(ts) < 0) ret = -1;
+  }
+
+  if (ret > 0) {
+    for (size_t i = 0; i < used; ++i) chunks[i].out_at += ts->count;
+    _chunks_each(chunks, used, _chunk_copy);
+    ts->count += total;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+    for (int s = 0; s < AT_STATES; ++s) _run_free(&chunks[i].runs[s]);
+  free(chunks);
+
+  return ret;
+}
+
+void lex_stream_load(lex_stream_t *ts, size_t i, lex_t *l) {
+  lex_token_t *t = &l->tok;
+  t->kind = lex_kind_unpack(ts->kinds[i]);
+  t->start = ts->starts[i];
+  t->len = ts->lens[i];
+  t->int_val = ts->values[i];
+  t->sym = t->kind == T_SYMBOL ? (sym_t)ts->values[i] : 0;
+  t->str_val_size = 0;
+
+  if (t->kind == T_STRLIT) {
+    _ensure_capacity(t, t->int_val + 1);
+    t->str_val_size = lex_unescape(lex_at(l, t->start + 1), t->int_val,
+                                   t->str_val);
+    t->str_val[t->str_val_size] = '\0';
+  }
+}
+
+void lex_stream_free(lex_stream_t *ts) {
+  free(ts->kinds);
+  free(ts->starts);
+  free(ts->lens);
+  free(ts->values);
+  memset(ts, 0, sizeof(*ts));
+}
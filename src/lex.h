@@ -1,20 +1,22 @@
 #ifndef LEX_H
 #define LEX_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "intern.h"
+
 #define LEX_MAX_SYMBOL_LEN 256
 
-typedef struct lex {
-  const char *file_path;
-  FILE *file;
-  long int_val;
-  char *str_val;
-  size_t str_val_size;
-  size_t str_val_capacity;
-  int line;
-  int col;
-} lex_t;
+// Read size for inputs that are streamed rather than mapped.
+#ifndef LEX_CHUNK_SIZE
+#define LEX_CHUNK_SIZE (64 * 1024)
+#endif
+
+// Number of tokens that can be looked ahead of the current one. Must be a
+// power of two.
+#define LEX_LOOKAHEAD 8
 
 typedef enum token {
   T_EOF = 256,
@@ -25,16 +27,187 @@ typedef enum token {
   T_LAST
 } token_t;
 
+// int_val of a T_INTLIT too large for a long, or malformed. Literals are
+// never negative otherwise.
+#define LEX_INT_OVERFLOW (-1)
+#define LEX_INT_INVALID (-2)
+
+typedef struct lex_token {
+  token_t kind;
+
+  // Token text as a view into the lexer input. Byte offsets are the only
+  // position kept; see lex_position().
+  uint32_t start;
+  uint32_t len;
+
+  // Value of a T_INTLIT, raw body length (without quotes) of a T_STRLIT.
+  long int_val;
+
+  // Interned id and intern_hash() of a T_SYMBOL.
+  sym_t sym;
+  uint32_t hash;
+
+  // Decoded string literal. Every token owns its buffer so that lookahead
+  // never has to copy text around.
+  char *str_val;
+  size_t str_val_size;
+  size_t str_val_capacity;
+} lex_token_t;
+
+typedef struct lex {
+  const char *file_path;
+
+  // Where diagnostics are written; stderr when NULL.
+  FILE *diag;
+
+  // Input window. Regular files are mmap'ed whole; pipes and stdin are read
+  // chunk by chunk into `buf`, in which case `src` only holds the bytes from
+  // absolute offset `base` on. Token offsets are always absolute.
+  const char *src;
+  size_t src_len;
+  size_t pos;
+  size_t base;
+  int mapped;
+
+  // Streamed input: bytes before absolute offset `keep` may be dropped.
+  int fd;
+
+  // Why a streamed input ended before its end: a read error, no memory or an
+  // input over 4 GB; empty when it did not. Tokens end there as if the input
+  // did, so the parser turns it into an error, see parser_next().
+  char error[128];
+
+  char *buf;
+  size_t buf_capacity;
+  size_t keep;
+
+  // Start offset of every line, built on demand by lex_position(). A
+  // streamed input is indexed as it is read, since diagnostics may point at
+  // bytes that left the window, so this grows by 4 bytes a line for the
+  // whole input; only the window itself stays bounded.
+  uint32_t *line_starts;
+  size_t line_count;
+  size_t line_capacity;
+
+  // Symbols looked up recently, so lexers on different threads rarely meet
+  // on the intern table's lock.
+  intern_cache_t *syms;
+
+  // Current token.
+  lex_token_t tok;
+
+  // Tokens already lexed past the current one.
+  lex_token_t ahead[LEX_LOOKAHEAD];
+  size_t ahead_head;
+  size_t ahead_count;
+} lex_t;
+
+// The whole input lexed ahead of parsing, as parallel arrays with one entry
+// per token. The last entry is always T_EOF.
+typedef struct lex_stream {
+  uint8_t *kinds;    // lex_kind_pack()ed token_t
+  uint32_t *starts;  // offset into the lexer input
+  uint32_t *lens;
+  int64_t *values;   // symbol id, integer value or raw string body length
+  size_t count;
+  size_t capacity;
+} lex_stream_t;
+
+// Punctuation is ASCII and keeps its value, T_* kinds are stored from 128 on.
+static inline uint8_t lex_kind_pack(token_t t) {
+  return t < 256 ? (uint8_t)t : (uint8_t)(128 + (t - T_EOF));
+}
+
+static inline token_t lex_kind_unpack(uint8_t k) {
+  return k < 128 ? (token_t)k : (token_t)(T_EOF + (k - 128));
+}
+
+// Opens `file_path`, or stdin when it is "-".
 int lex_init(lex_t *l, const char *file_path);
 
+// Lexes `len` bytes of `src`, which the caller owns and keeps alive. `name`
+// is only used in diagnostics.
+int lex_init_buffer(lex_t *l, const char *name, const char *src, size_t len);
+
+// Input bytes at absolute `offset`. Streamed inputs only keep the current
+// token and what follows it.
+static inline const char *lex_at(const lex_t *l, uint32_t offset) {
+  return l->src + (offset - l->base);
+}
+
 token_t lex_next(lex_t *l);
 
+// Continues lexing at absolute `offset`, a token start still in the window,
+// dropping any lookahead. Returns -1 when the window no longer holds it.
+int lex_seek(lex_t *l, uint32_t offset);
+
+// Returns the kind of the n-th token after the current one, n >= 1.
+token_t lex_peek_nth(lex_t *l, size_t n);
+
+// Same as lex_peek_nth, but gives access to the whole token.
+const lex_token_t *lex_lookahead(lex_t *l, size_t n);
+
 token_t lex_peek(lex_t *l);
 
+// Returns the current token text as a view into the input. It is not NUL
+// terminated; the length is stored in `len`. The view is only valid until the
+// next lex_next or lookahead.
+const char *lex_text(lex_t *l, size_t *len);
+
+// Copies the current symbol into `tok.str_val` and returns it NUL terminated.
+// String literals are always decoded into `tok.str_val` by lex_next.
+char *lex_str(lex_t *l);
+
+// Decodes the escape sequences of a raw string literal body into `out`,
+// which must hold at least `len` bytes. Returns the decoded length.
+size_t lex_unescape(const char *raw, size_t len, char *out);
+
+// Longest symbol or string text lex_kind_label() copies, so that labels fit
+// in LEX_MAX_SYMBOL_LEN bytes.
+#define LEX_LABEL_TEXT 200
+
+// Describes token kind `t`, with the current token's text or value when `t`
+// is the current token's kind. `buf` must hold LEX_MAX_SYMBOL_LEN bytes.
 void lex_kind_label(lex_t *l, token_t t, char *buf);
 
+// Converts a byte offset into 1-based line and column numbers.
+void lex_position(lex_t *l, uint32_t offset, int *line, int *col);
+
+// Reports an error at the current token.
 void lex_report_err(lex_t *lexer, const char *fmt, ...);
 
+void lex_report_err_at(lex_t *lexer, uint32_t offset, const char *fmt, ...);
+
+void lex_report_warn_at(lex_t *lexer, uint32_t offset, const char *fmt, ...);
+
 void lex_free(lex_t *l);
 
+// Lexes everything the lexer has not consumed yet into `ts`. The stream
+// keeps offsets into the lexer input, so the lexer must outlive it.
+int lex_stream_init(lex_stream_t *ts, lex_t *l);
+
+// Same as lex_stream_init, with the input split at line boundaries into up
+// to `threads` chunks that are lexed concurrently. Produces the same stream,
+// symbol ids included. Small inputs are lexed on the calling thread.
+int lex_stream_init_parallel(lex_stream_t *ts, lex_t *l, size_t threads);
+
+// Loads token `i` of the stream into the lexer's current token, so the usual
+// lex_kind_label/lex_report_err can describe it.
+void lex_stream_load(lex_stream_t *ts, size_t i, lex_t *l);
+
+// Bytes [start, start + removed) of an input replaced by `inserted` new ones.
+typedef struct lex_edit {
+  uint32_t start;
+  uint32_t removed;
+  uint32_t inserted;
+} lex_edit_t;
+
+// Brings `ts`, a stream of a whole input, up to date after `edit`. `l` lexes
+// the edited input. Only the tokens from the last one ending before the edit
+// up to where lexing falls back in step with the old stream are lexed again;
+// the rest are kept, moved by the size of the edit.
+int lex_stream_update(lex_stream_t *ts, lex_t *l, const lex_edit_t *edit);
+
+void lex_stream_free(lex_stream_t *ts);
+
 #endif /* ifndef LEX_H */
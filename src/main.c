@@ -1,40 +1,516 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "arena.h"
 #include "ast.h"
+#include "cache.h"
+#include "intern.h"
 #include "interpreter.h"
+#include "output.h"
+#include "pool.h"
+#include "queue.h"
+#include "resolve.h"
+#include "scan.h"
 
 typedef enum compiler_action {
   CA_LEXDUMP = 0,
   CA_ASTDUMP,
+  CA_ASTSTATS,
+  CA_BCDUMP,
   CA_INTERPRET,
+  CA_LEXBENCH,
+  CA_EDITBENCH,
 } compiler_action_t;
 
+#define LEXBENCH_ROUNDS 10
+#define EDITBENCH_ROUNDS 50
+
+typedef struct input_da {
+  size_t count, capacity;
+  char** items;
+} input_da_t;
+
+// One input of a multi-file build.
+typedef struct unit {
+  const char* path;
+  bool prelex;
+
+  // AST cache directory, or NULL.
+  const char* cache;
+  bool cached;
+
+  // Diagnostics, printed in input order once every unit is done.
+  char* diag;
+  size_t diag_len;
+
+  size_t nodes;
+  double seconds;
+  bool failed;
+} unit_t;
+
 static inline char* shift(char*** argv) { return **argv ? *(*argv)++ : NULL; }
 
-int main(int argc, char** argv) {
-  Arena arena = {0};
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <input>\n", argv[0]);
-    fprintf(stderr, "Error: Missing input file path");
+// Lexes the whole input LEXBENCH_ROUNDS times, including mapping it, and
+// reports the throughput. With `threads` set, the input is lexed into a token
+// stream on that many threads instead of token by token.
+static int lex_bench(const char* file_input, size_t threads) {
+  size_t bytes = 0, tokens = 0;
+  double start = now_sec();
+
+  for (int i = 0; i < LEXBENCH_ROUNDS; ++i) {
+    lex_t lexer = {0};
+    if (lex_init(&lexer, file_input) < 0) {
+      perror("lex_init");
+      return 1;
+    }
+    if (threads > 0) {
+      lex_stream_t stream = {0};
+      if (lex_stream_init_parallel(&stream, &lexer, threads) < 0) {
+        fprintf(stderr, "Error: Could not lex %s\n", file_input);
+        return 1;
+      }
+      tokens += stream.count - 1;
+      lex_stream_free(&stream);
+    } else {
+      while (lex_next(&lexer) != T_EOF) tokens++;
+    }
+    if (lexer.error[0]) {
+      lex_report_err(&lexer, "%s", lexer.error);
+      return 1;
+    }
+    bytes += lexer.src_len;
+    lex_free(&lexer);
+  }
+  intern_free();
+
+  double elapsed = now_sec() - start;
+  if (threads > 0) printf("[%s, threads=%zu] ", scan->name, threads);
+  else printf("[%s] ", scan->name);
+  printf("lexed %zu bytes, %zu tokens in %.3fs: %.1f MB/s\n", bytes, tokens,
+         elapsed, bytes / elapsed / 1e6);
+  return 0;
+}
+
+static bool stream_equal(const lex_stream_t* a, const lex_stream_t* b) {
+  return a->count == b->count &&
+         memcmp(a->kinds, b->kinds, a->count * sizeof(*a->kinds)) == 0 &&
+         memcmp(a->starts, b->starts, a->count * sizeof(*a->starts)) == 0 &&
+         memcmp(a->lens, b->lens, a->count * sizeof(*a->lens)) == 0 &&
+         memcmp(a->values, b->values, a->count * sizeof(*a->values)) == 0;
+}
+
+// Keystroke latency: inserts a byte at a random offset of an in-memory copy
+// of the input and deletes it again, EDITBENCH_ROUNDS times. Every edit
+// updates the token stream incrementally; the result is checked against,
+// and timed next to, lexing the edited input from scratch.
+static int edit_bench(const char* file_input) {
+  lex_t lexer = {0};
+  if (lex_init(&lexer, file_input) < 0) {
+    perror("lex_init");
     return 1;
   }
 
-  ++argv;
-  char* file_input = shift(&argv);
+  size_t len = lexer.src_len;
+  char* text = malloc(len + 1);
+  if (!text) return 1;
+  memcpy(text, lexer.src, len);
+  lex_free(&lexer);
+
+  lex_stream_t stream = {0};
+  lexer = (lex_t){0};
+  lex_init_buffer(&lexer, file_input, text, len);
+  if (lex_stream_init(&stream, &lexer) < 0) return 1;
+  lex_free(&lexer);
+
+  const char keys[] = "x 9;(\"";
+  double incremental = 0, full = 0;
+  size_t mismatches = 0;
+  lex_edit_t edit = {0};
+  srand(1);
+
+  for (int i = 0; i < EDITBENCH_ROUNDS * 2; ++i) {
+    if (i % 2 == 0) {
+      edit.start = len ? rand() % len : 0;
+      edit.removed = 0;
+      edit.inserted = 1;
+      memmove(text + edit.start + 1, text + edit.start, len - edit.start);
+      text[edit.start] = keys[(i / 2) % (sizeof(keys) - 1)];
+      len++;
+    } else {
+      edit.removed = 1;
+      edit.inserted = 0;
+      memmove(text + edit.start, text + edit.start + 1, len - edit.start - 1);
+      len--;
+    }
+
+    double start = now_sec();
+    lexer = (lex_t){0};
+    lex_init_buffer(&lexer, file_input, text, len);
+    if (lex_stream_update(&stream, &lexer, &edit) < 0) return 1;
+    incremental += now_sec() - start;
+    lex_free(&lexer);
+
+    lex_stream_t fresh = {0};
+    start = now_sec();
+    lexer = (lex_t){0};
+    lex_init_buffer(&lexer, file_input, text, len);
+    if (lex_stream_init(&fresh, &lexer) < 0) return 1;
+    full += now_sec() - start;
+    lex_free(&lexer);
+
+    if (!stream_equal(&stream, &fresh)) mismatches++;
+    lex_stream_free(&fresh);
+  }
+
+  int edits = EDITBENCH_ROUNDS * 2;
+  printf("%d edits on %zu bytes: incremental %.1f us, full %.1f us per edit, "
+         "%zu mismatches\n",
+         edits, len, incremental / edits * 1e6, full / edits * 1e6,
+         mismatches);
+
+  lex_stream_free(&stream);
+  free(text);
+  intern_free();
+  return mismatches > 0;
+}
+
+// Appends the paths listed in response file `path`, one per line. Empty
+// lines are skipped.
+static int read_response_file(Arena* arena, const char* path,
+                              input_da_t* inputs) {
+  FILE* f = fopen(path, "r");
+  if (!f) return -1;
+
+  char* line = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  while ((len = getline(&line, &capacity, f)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len > 0) arena_da_append(arena, inputs, arena_strdup(arena, line));
+  }
+
+  free(line);
+  fclose(f);
+  return 0;
+}
+
+// Resolves an AST without syntax errors, `lazy` when bodies may be missing.
+// Returns false when it has errors, which are reported. Cache entries do not
+// keep the warnings, so a loaded AST is resolved again as well.
+static bool resolve_tree(lex_t* lexer, ast_t* ast, bool lazy) {
+  resolver_t r;
+  resolver_init(&r, lexer);
+  r.check_calls = !lazy;
+  r.bind_calls = !lazy;
+  size_t errors = resolve_ast(&r, ast);
+  resolver_free(&r);
+  return errors == 0;
+}
+
+static bool parse_unit(parser_t* p, unit_t* u) {
+  while (parser_next(p) != AST_NIL) continue;
+  u->nodes = p->ast.node_count;
+  parser_report(p, 0);
+  return p->error_count == 0 && resolve_tree(p->lexer, &p->ast, p->lazy);
+}
+
+// Lexes and parses one unit, keeping its diagnostics to itself.
+static void check_unit(size_t i, void* ctx) {
+  unit_t* u = &((unit_t*)ctx)[i];
+  double start = now_sec();
+  FILE* diag = open_memstream(&u->diag, &u->diag_len);
+
+  lex_t lexer = {0};
+  if (lex_init(&lexer, u->path) < 0) {
+    fprintf(diag ? diag : stderr, "%s: error: %s\n", u->path, strerror(errno));
+    u->failed = true;
+  } else {
+    parser_t p = {0};
+    lex_stream_t stream = {0};
+    ast_t cached = {0};
+    uint64_t key = 0;
+    lexer.diag = diag;
+
+    // Only mapped inputs are cached, as only they are in memory whole.
+    bool cache = u->cache && lexer.mapped;
+    if (cache) {
+      key = cache_key(lexer.src, lexer.src_len);
+      u->cached = cache_load(u->cache, key, lexer.src_len, &cached) > 0;
+      u->nodes = cached.node_count;
+    }
+
+    if (u->cached) {
+      u->failed = !resolve_tree(&lexer, &cached, false);
+      ast_free(&cached);
+    } else if (!u->prelex) {
+      parser_init(&p, &lexer);
+    } else if (lex_stream_init(&stream, &lexer) < 0) {
+      fprintf(diag ? diag : stderr, "%s: error: out of memory\n", u->path);
+      u->failed = true;
+    } else {
+      parser_init_stream(&p, &lexer, &stream);
+    }
+
+    if (!u->cached && !u->failed) {
+      u->failed = !parse_unit(&p, u);
+      if (!u->failed && cache &&
+          cache_store(u->cache, key, lexer.src_len, &p.ast) < 0)
+        fprintf(diag ? diag : stderr, "%s: warning: could not cache: %s\n",
+                u->path, strerror(errno));
+    }
+
+    parser_free(&p);
+    lex_stream_free(&stream);
+  }
+
+  lex_free(&lexer);
+  if (diag) fclose(diag);
+  u->seconds = now_sec() - start;
+}
+
+// Lexes and parses every input on a pool of `jobs` threads. Diagnostics and
+// timings are reported in input order, whatever order the units finish in.
+static int build(input_da_t* inputs, size_t jobs, bool prelex, bool timing,
+                 const char* cache) {
+  unit_t* units = calloc(inputs->count, sizeof(*units));
+  if (!units) return 1;
+
+  for (size_t i = 0; i < inputs->count; ++i) {
+    units[i].path = inputs->items[i];
+    units[i].prelex = prelex;
+    units[i].cache = cache;
+  }
+
+  double start = now_sec();
+  pool_run(inputs->count, jobs, check_unit, units);
+  double wall = now_sec() - start, work = 0;
+
+  size_t failed = 0;
+  for (size_t i = 0; i < inputs->count; ++i) {
+    unit_t* u = &units[i];
+    if (u->diag_len > 0) fwrite(u->diag, 1, u->diag_len, stderr);
+    if (timing)
+      fprintf(stderr, "%s: %.3f ms, %zu nodes%s\n", u->path, u->seconds * 1e3,
+              u->nodes, u->failed ? ", failed" : u->cached ? ", cached" : "");
+    failed += u->failed;
+    work += u->seconds;
+    free(u->diag);
+  }
+
+  if (timing)
+    fprintf(stderr, "%zu files, %zu failed: %.3fs wall, %.3fs of work on %zu "
+            "jobs\n", inputs->count, failed, wall, work,
+            jobs < inputs->count ? jobs : inputs->count);
+
+  free(units);
+  intern_free();
+  return failed > 0;
+}
+
+#define PIPELINE_DEPTH 64
+
+// A run in which the parser works on its own thread and hands every top level
+// item, in an ast_copy() of its own, to the interpreter on the calling thread.
+typedef struct pipeline {
+  parser_t* parser;
+  queue_t queue;
+  bool failed;
+} pipeline_t;
+
+static void* parse_items(void* arg) {
+  pipeline_t* pl = arg;
+  parser_t* p = pl->parser;
+
+  // Later items are not parsed yet, so calls are left to the interpreter.
+  resolver_t r;
+  resolver_init(&r, p->lexer);
+  r.check_calls = false;
+
+  while (parser_next(p) != AST_NIL) {
+    // Nothing runs after an error; the rest is only checked.
+    ast_t* item = NULL;
+    if (p->error_count == 0 && resolve_ast(&r, &p->ast) > 0) pl->failed = true;
+    if (p->error_count == 0 && !pl->failed && !(item = ast_copy(&p->ast))) {
+      fprintf(stderr, "Error: Out of memory\n");
+      pl->failed = true;
+      break;
+    }
+    parser_reset_ast(p);
+    if (item) queue_push(&pl->queue, item);
+  }
+
+  if (p->error_count) {
+    parser_report(p, 0);
+    pl->failed = true;
+  }
+  resolver_free(&r);
+  queue_close(&pl->queue);
+  return NULL;
+}
+
+static bool next_item(void* ctx, const ast_t** ast, ast_ref_t* root) {
+  ast_t* item = queue_pop(&((pipeline_t*)ctx)->queue);
+  if (!item) return false;
+  *ast = item;
+  *root = item->roots[0];
+  return true;
+}
+
+static void release_item(void* ctx, const ast_t* ast, ast_ref_t root) {
+  (void)ctx;
+  (void)root;
+  free((ast_t*)ast);
+}
+
+// Only asked once the queue is closed; `failed` is set before that.
+static bool feed_failed(void* ctx) {
+  return ((pipeline_t*)ctx)->failed;
+}
+
+// Runs items while the rest of the input is still being parsed. Items before
+// the first error still run, until one needs a function from past it.
+// Returns the exit status.
+static int run_pipelined(parser_t* p) {
+  pipeline_t pl = {.parser = p};
+  pthread_t thread;
+
+  p->lazy = false;
+  if (queue_init(&pl.queue, PIPELINE_DEPTH) < 0 ||
+      pthread_create(&thread, NULL, parse_items, &pl) != 0) {
+    fprintf(stderr, "Error: Could not start the parser thread\n");
+    queue_free(&pl.queue);
+    return 1;
+  }
+
+  interpreter_feed_t feed = {next_item, release_item, feed_failed, &pl};
+  int status = interpreter_feed(&feed, NULL);
+
+  // Items the interpreter stopped before, so the parser is never blocked.
+  for (ast_t* item; (item = queue_pop(&pl.queue)) != NULL;) free(item);
+  pthread_join(thread, NULL);
+
+  queue_free(&pl.queue);
+  return pl.failed || status < 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  Arena arena = {0};
+  const char* argv0 = argv[0];
+
   compiler_action_t action = CA_INTERPRET;
+  bool prelex = false;
+  bool timing = false;
+  bool lazy = false;
+  bool pipelined = false;
+  int ret = 0;
+  bool response = false;
+  size_t lex_threads = 0;
+  size_t jobs = 0;
+  const char* cache_dir = NULL;
+  // Unbuffered on a terminal, unless -outbuf says otherwise.
+  size_t outbuf = isatty(STDOUT_FILENO) ? 0 : OUTPUT_DEFAULT_SIZE;
+  input_da_t inputs = {0};
 
+  ++argv;
   char* flag;
   while ((flag = shift(&argv)) != NULL) {
     if      (strcmp(flag, "-lexdump") == 0) action = CA_LEXDUMP;
     else if (strcmp(flag, "-astdump") == 0) action = CA_ASTDUMP;
+    else if (strcmp(flag, "-aststats") == 0) action = CA_ASTSTATS;
+    else if (strcmp(flag, "-bcdump") == 0) action = CA_BCDUMP;
+    else if (strcmp(flag, "-vmstats") == 0) interpreter_stats(true);
+    else if (strcmp(flag, "-lexbench") == 0) action = CA_LEXBENCH;
+    else if (strcmp(flag, "-editbench") == 0) action = CA_EDITBENCH;
+    else if (strcmp(flag, "-prelex") == 0) prelex = true;
+    else if (strcmp(flag, "-time") == 0) timing = true;
+    else if (strcmp(flag, "-lazy") == 0) lazy = true;
+    else if (strcmp(flag, "-pipeline") == 0) pipelined = true;
+    else if (strncmp(flag, "-lexthreads=", 12) == 0) {
+      lex_threads = strtoul(flag + 12, NULL, 10);
+      if (lex_threads == 0) {
+        fprintf(stderr, "Error: Invalid thread count '%s'\n", flag + 12);
+        return 1;
+      }
+      prelex = true;
+    } else if (strncmp(flag, "-jobs=", 6) == 0) {
+      jobs = strtoul(flag + 6, NULL, 10);
+      if (jobs == 0) {
+        fprintf(stderr, "Error: Invalid job count '%s'\n", flag + 6);
+        return 1;
+      }
+    } else if (strncmp(flag, "-outbuf=", 8) == 0) {
+      char* end;
+      outbuf = strtoul(flag + 8, &end, 10);
+      if (end == flag + 8 || *end != '\0') {
+        fprintf(stderr, "Error: Invalid output buffer size '%s'\n", flag + 8);
+        return 1;
+      }
+    } else if (strncmp(flag, "-cache=", 7) == 0) {
+      cache_dir = flag + 7;
+    } else if (strncmp(flag, "-engine=", 8) == 0) {
+      if (interpreter_select(flag + 8) < 0) {
+        fprintf(stderr, "Error: Unknown engine '%s'\n", flag + 8);
+        return 1;
+      }
+    } else if (strncmp(flag, "-scan=", 6) == 0) {
+      if (scan_select(flag + 6) < 0) {
+        fprintf(stderr, "Error: Unsupported scanner '%s'\n", flag + 6);
+        return 1;
+      }
+    } else if (flag[0] == '@') {
+      if (read_response_file(&arena, flag + 1, &inputs) < 0) {
+        fprintf(stderr, "Error: Could not read %s: %s\n", flag + 1,
+                strerror(errno));
+        return 1;
+      }
+      response = true;
+    } else if (flag[0] != '-' || flag[1] == '\0') {
+      arena_da_append(&arena, &inputs, flag);
+    }
+  }
+
+  if (argc < 2 || (inputs.count == 0 && !response)) {
+    fprintf(stderr, "Usage: %s <input | - | @list>... [flags]\n", argv0);
+    fprintf(stderr, "Error: Missing input file path");
+    return 1;
+  }
+
+  if (action == CA_INTERPRET && output_init(STDOUT_FILENO, outbuf) < 0)
+    fprintf(stderr, "Warning: Could not allocate the output buffer\n");
+
+  if (response || inputs.count > 1) {
+    if (action != CA_INTERPRET) {
+      fprintf(stderr, "Error: Only a single input can be dumped, "
+              "benchmarked or run\n");
+      return 1;
+    }
+    ret = build(&inputs, jobs ? jobs : pool_cpus(), prelex, timing,
+                    cache_dir);
+    arena_free(&arena);
+    return ret;
   }
 
+  char* file_input = inputs.items[0];
+
+  if (action == CA_LEXBENCH) return lex_bench(file_input, lex_threads);
+  if (action == CA_EDITBENCH) return edit_bench(file_input);
+
   lex_t lexer = {0};
   if (lex_init(&lexer, file_input) < 0) {
     perror("lex_init");
@@ -48,24 +524,117 @@ int main(int argc, char** argv) {
       lex_kind_label(&lexer, token, buf);
       printf("%s\n", buf);
     }
+    if (lexer.error[0]) {
+      lex_report_err(&lexer, "%s", lexer.error);
+      ret = 1;
+    }
   } else {
     parser_t p = {0};
-    parser_init(&p, &lexer);
+    lex_stream_t stream = {0};
+    ast_t cached = {0};
+    const ast_t* ast = &p.ast;
+    uint64_t key = 0;
+    double start = now_sec();
+
+    bool cache = cache_dir && lexer.mapped;
+    if (cache) {
+      key = cache_key(lexer.src, lexer.src_len);
+      if (cache_load(cache_dir, key, lexer.src_len, &cached) > 0) ast = &cached;
+      if (timing)
+        fprintf(stderr, "cache: %.3fs (%s)\n", now_sec() - start,
+                ast == &cached ? "hit" : "miss");
+      start = now_sec();
+    }
+
+    if (ast == &cached) {
+      if (action == CA_ASTDUMP)
+        for (uint32_t i = 0; i < cached.root_count; ++i)
+          parser_print_node(&cached, cached.roots[i]);
+
+      start = now_sec();
+      if (!resolve_tree(&lexer, &cached, false)) {
+        ret = 1;
+        ast = NULL;
+      }
+      if (timing) fprintf(stderr, "resolve: %.3fs\n", now_sec() - start);
+    } else {
+      if (prelex) {
+        if (lex_stream_init_parallel(&stream, &lexer, lex_threads) < 0) {
+          fprintf(stderr, "Error: Could not lex %s\n", file_input);
+          return 1;
+        }
+        if (timing)
+          fprintf(stderr, "lex:   %.3fs (%zu tokens)\n", now_sec() - start,
+                  stream.count);
+        start = now_sec();
+        parser_init_stream(&p, &lexer, &stream);
+      } else {
+        parser_init(&p, &lexer);
+      }
+
+      // Dumps and checks need every body.
+      p.lazy = lazy && action == CA_INTERPRET;
 
-    ast_node_t* node;
-    ast_node_da_t node_list = {0};
-    while ((node = parser_next(&p)) != NULL) {
-      if (action == CA_ASTDUMP) parser_print_node(node);
-      else arena_da_append(&arena, &node_list, node);
+      if (pipelined && action == CA_INTERPRET) {
+        ret = run_pipelined(&p);
+        if (timing)
+          fprintf(stderr, "%s %.3fs\n",
+                  prelex ? "parse+run:" : "lex+parse+run:", now_sec() - start);
+        ast = NULL;
+      } else {
+        ast_ref_t node;
+        while ((node = parser_next(&p)) != AST_NIL) {
+          if (action == CA_ASTDUMP) parser_print_node(&p.ast, node);
+        }
+
+        if (timing)
+          fprintf(stderr, "%s %.3fs\n", prelex ? "parse:" : "lex+parse:",
+                  now_sec() - start);
+
+        if (p.error_count) {
+          parser_report(&p, 0);
+          ret = 1;
+          ast = NULL;
+        } else {
+          start = now_sec();
+          if (!resolve_tree(&lexer, &p.ast, p.lazy)) {
+            ret = 1;
+            ast = NULL;
+          }
+          if (timing)
+            fprintf(stderr, "resolve: %.3fs\n", now_sec() - start);
+        }
+
+        // Skipped bodies are only ever parsed by this process.
+        if (ast && cache && !p.lazy &&
+            cache_store(cache_dir, key, lexer.src_len, &p.ast) < 0)
+          fprintf(stderr, "Warning: Could not cache %s: %s\n", file_input,
+                  strerror(errno));
+      }
     }
 
-    if (action == CA_INTERPRET) interpreter_run(&node_list);
+    if (action == CA_ASTSTATS && ast)
+      ast_print_stats(ast, lexer.base + lexer.src_len);
+
+    if (action == CA_BCDUMP && ast) interpreter_dump(ast);
 
+    start = now_sec();
+
+    if (action == CA_INTERPRET && ast &&
+        interpreter_run(ast, ast == &p.ast ? &p : NULL) < 0)
+      ret = 1;
+
+    if (timing && action == CA_INTERPRET && ast)
+      fprintf(stderr, "run:   %.3fs\n", now_sec() - start);
+
+    ast_free(&cached);
     parser_free(&p);
+    lex_stream_free(&stream);
   }
 
   lex_free(&lexer);
+  intern_free();
   arena_free(&arena);
 
-  return 0;
+  return ret;
 }
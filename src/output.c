@@ -0,0 +1,84 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "output.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int output_fd = STDOUT_FILENO;
+static char *output_buf;
+static size_t output_size, output_len;
+
+// Set once a write fails, until the next output_flush().
+static bool output_failed;
+
+// Writes all of `iov`, going on after short writes.
+static void _output_writev(struct iovec *iov, int count) {
+  while (count > 0 && !output_failed) {
+    if (iov->iov_len == 0) {
+      ++iov;
+      --count;
+      continue;
+    }
+
+    ssize_t n = writev(output_fd, iov, count);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      output_failed = true;
+      break;
+    }
+
+    for (; count > 0 && (size_t)n >= iov->iov_len; ++iov, --count)
+      n -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+static void _output_exit(void) {
+  output_flush();
+  free(output_buf);
+  output_buf = NULL;
+  output_size = 0;
+}
+
+int output_init(int fd, size_t size) {
+  static bool registered;
+  if (!registered) registered = atexit(_output_exit) == 0;
+
+  output_flush();
+  free(output_buf);
+  output_fd = fd;
+  output_buf = size > 0 ? malloc(size) : NULL;
+  output_size = output_buf ? size : 0;
+  return size > 0 && !output_buf ? -1 : 0;
+}
+
+void output_write(const char *s, size_t len) {
+  if (len <= output_size - output_len) {
+    memcpy(output_buf + output_len, s, len);
+    output_len += len;
+    return;
+  }
+
+  // Out together with what is buffered, rather than in a write of its own.
+  struct iovec iov[2] = {{output_buf, output_len}, {(char *)s, len}};
+  _output_writev(iov, 2);
+  output_len = 0;
+}
+
+int output_flush(void) {
+  struct iovec iov = {output_buf, output_len};
+  _output_writev(&iov, 1);
+  output_len = 0;
+
+  int ret = output_failed ? -1 : 0;
+  output_failed = false;
+  return ret;
+}
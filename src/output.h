@@ -0,0 +1,23 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+#define OUTPUT_DEFAULT_SIZE (64 * 1024)
+
+// Output of the program being run. It collects in a buffer of its own and
+// goes to the file descriptor in one writev() together with the piece that
+// no longer fits, on output_flush(), or at exit.
+//
+// Sends output to `fd` through a buffer of `size` bytes, 0 to write every
+// piece as it comes. What was buffered before is flushed first. Returns -1
+// when the buffer cannot be allocated, and then writes unbuffered.
+int output_init(int fd, size_t size);
+
+void output_write(const char *s, size_t len);
+
+// Writes out everything buffered. Returns -1 if a write failed since the
+// last call; the output from the failure on is lost.
+int output_flush(void);
+
+#endif /* ifndef OUTPUT_H */
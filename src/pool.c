@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Tasks [next, end) not started yet. The owner takes from the front, thieves
+// take the back half.
+typedef struct pool_deque {
+  pthread_mutex_t lock;
+  size_t next, end;
+} pool_deque_t;
+
+typedef struct pool {
+  pool_deque_t *deques;
+  size_t workers;
+  pool_task_fn fn;
+  void *ctx;
+} pool_t;
+
+typedef struct pool_worker {
+  pool_t *pool;
+  size_t id;
+} pool_worker_t;
+
+static int _pool_take(pool_deque_t *d, size_t *task) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->next < d->end) {
+    *task = d->next++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Moves the back half of a victim's tasks to `self` and takes the first.
+static int _pool_steal(pool_t *pool, size_t self, size_t *task) {
+  for (size_t i = 1; i < pool->workers; ++i) {
+    pool_deque_t *victim = &pool->deques[(self + i) % pool->workers];
+    size_t from = 0, to = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->next < victim->end) {
+      from = victim->next + (victim->end - victim->next) / 2;
+      to = victim->end;
+      victim->end = from;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (from == to) continue;
+
+    pool_deque_t *own = &pool->deques[self];
+    pthread_mutex_lock(&own->lock);
+    own->next = from + 1;
+    own->end = to;
+    pthread_mutex_unlock(&own->lock);
+    *task = from;
+    return 1;
+  }
+  return 0;
+}
+
+static void *_pool_work(void *arg) {
+  pool_worker_t *w = arg;
+  pool_t *pool = w->pool;
+  size_t task;
+
+  // Nothing adds tasks, so once a whole round of stealing comes back empty
+  // there is nothing left to start.
+  while (_pool_take(&pool->deques[w->id], &task) ||
+         _pool_steal(pool, w->id, &task))
+    pool->fn(task, pool->ctx);
+
+  return NULL;
+}
+
+void pool_run(size_t count, size_t workers, pool_task_fn fn, void *ctx) {
+  if (workers > count) workers = count;
+  if (workers < 1) workers = 1;
+
+  pool_t pool = {0};
+  pool.workers = workers;
+  pool.fn = fn;
+  pool.ctx = ctx;
+  pool.deques = malloc(workers * sizeof(*pool.deques));
+  pthread_t *threads = malloc(workers * sizeof(*threads));
+  pool_worker_t *ws = malloc(workers * sizeof(*ws));
+
+  int *started = calloc(workers, sizeof(*started));
+
+  if (!pool.deques || !threads || !ws || !started) {
+    for (size_t i = 0; i < count; ++i) fn(i, ctx);
+  } else {
+    for (size_t i = 0; i < workers; ++i) {
+      pthread_mutex_init(&pool.deques[i].lock, NULL);
+      pool.deques[i].next = count * i / workers;
+      pool.deques[i].end = count * (i + 1) / workers;
+      ws[i].pool = &pool;
+      ws[i].id = i;
+    }
+
+    // A worker whose thread cannot be started leaves its tasks to be
+    // stolen.
+    for (size_t i = 1; i < workers; ++i)
+      started[i] = pthread_create(&threads[i], NULL, _pool_work, &ws[i]) == 0;
+
+    _pool_work(&ws[0]);
+
+    for (size_t i = 1; i < workers; ++i)
+      if (started[i]) pthread_join(threads[i], NULL);
+    for (size_t i = 0; i < workers; ++i)
+      pthread_mutex_destroy(&pool.deques[i].lock);
+  }
+
+  free(pool.deques);
+  free(threads);
+  free(ws);
+  free(started);
+}
+
+size_t pool_cpus(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+}
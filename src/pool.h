@@ -0,0 +1,17 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+typedef void (*pool_task_fn)(size_t task, void *ctx);
+
+// Runs fn(task, ctx) for every task in [0, count) on up to `workers`
+// threads, the calling one included, and returns once all are done. Every
+// worker starts on its own slice of the tasks, in order, and steals half of
+// what another has left when it runs out.
+void pool_run(size_t count, size_t workers, pool_task_fn fn, void *ctx);
+
+// Number of online CPUs, at least 1.
+size_t pool_cpus(void);
+
+#endif /* ifndef POOL_H */
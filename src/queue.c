@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "queue.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Yields to the other side first, then sleeps, so that a side that waits
+// for long does not keep a CPU busy.
+static void _queue_backoff(unsigned *tries) {
+  if (++*tries < 64) {
+    sched_yield();
+  } else {
+    struct timespec ts = {0, 20 * 1000};
+    nanosleep(&ts, NULL);
+  }
+}
+
+int queue_init(queue_t *q, size_t capacity) {
+  size_t n = 1;
+  while (n < capacity) n *= 2;
+
+  *q = (queue_t){0};
+  q->slots = malloc(n * sizeof(*q->slots));
+  if (!q->slots) return -1;
+  q->mask = n - 1;
+  return 0;
+}
+
+void queue_push(queue_t *q, void *item) {
+  size_t tail = q->tail;
+  unsigned tries = 0;
+  while (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask)
+    _queue_backoff(&tries);
+
+  q->slots[tail & q->mask] = item;
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void queue_close(queue_t *q) {
+  __atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+}
+
+void *queue_pop(queue_t *q) {
+  size_t head = q->head;
+  unsigned tries = 0;
+  for (;;) {
+    // Items pushed before the queue was closed are still delivered.
+    int closed = __atomic_load_n(&q->closed, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) != head) break;
+    if (closed) return NULL;
+    _queue_backoff(&tries);
+  }
+
+  void *item = q->slots[head & q->mask];
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+void queue_free(queue_t *q) {
+  free(q->slots);
+  q->slots = NULL;
+}
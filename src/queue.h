@@ -0,0 +1,36 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+
+// Bounded queue of pointers between one producer and one consumer thread.
+// Push and pop never take a lock; a side that finds the queue full or empty
+// backs off until the other one catches up.
+typedef struct queue {
+  void **slots;
+  size_t mask;
+
+  // Kept on separate cache lines, as each is written by a different thread.
+  char pad0[64];
+  size_t head;  // next slot to pop, written by the consumer
+  char pad1[64];
+  size_t tail;  // next slot to push, written by the producer
+  int closed;
+  char pad2[64];
+} queue_t;
+
+// `capacity` is rounded up to a power of two.
+int queue_init(queue_t *q, size_t capacity);
+
+void queue_push(queue_t *q, void *item);
+
+// Tells the consumer no more items will be pushed.
+void queue_close(queue_t *q);
+
+// Returns the oldest item, waiting for one if needed, or NULL once the queue
+// is closed and empty.
+void *queue_pop(queue_t *q);
+
+void queue_free(queue_t *q);
+
+#endif /* ifndef QUEUE_H */
@@ -0,0 +1,262 @@
+#include "resolve.h"
+
+#include <assert.h>
+
+#include "builtin.h"
+#include "stb_ds.h"
+
+// A node being walked, and what entering it replaced. Nesting lives here
+// rather than on the C stack, like in the parser.
+typedef struct resolve_step {
+  ast_ref_t ref;
+  uint32_t next;   // index of the next child to walk
+  uint32_t mark;   // length of `decls` when the node was entered
+  uint32_t scope;  // `mark` of the enclosing scope
+  uint32_t base;   // first declaration of the enclosing function
+  uint32_t slots;  // frame size of the enclosing function so far
+  bool in_function;
+} resolve_step_t;
+
+// State of the walk, saved in every step that changes it.
+typedef struct resolve_state {
+  resolve_step_t *steps;
+  uint32_t scope, base, slots;
+  bool in_function;
+} resolve_state_t;
+
+// A function defined more than once, or inside another function. The one
+// that runs depends on what ran before, so calls to it are not bound.
+#define RESOLVE_DYNAMIC UINT32_MAX
+
+void resolver_init(resolver_t *r, lex_t *lexer) {
+  *r = (resolver_t){0};
+  r->lexer = lexer;
+  r->check_calls = true;
+  r->bind_calls = true;
+}
+
+// Symbols are interned as the input is parsed, so the tables grow with them.
+static void _resolve_grow(resolver_t *r) {
+  size_t count = intern_count();
+  if (count < SYM_LAST) count = SYM_LAST;
+  while (arrlenu(r->functions) < count) arrput(r->functions, AST_NIL);
+  while (arrlenu(r->visible) < count) arrput(r->visible, 0);
+}
+
+static void _resolve_define(resolver_t *r, const ast_t *ast, ast_ref_t ref) {
+  sym_t name = ast_name(ast, ref);
+  r->functions[name] = r->functions[name] == AST_NIL ? ref : RESOLVE_DYNAMIC;
+}
+
+// Notes the functions defined by the nodes added since the last scan. Top
+// level ones go first, so a function defined anywhere else is dynamic.
+static void _resolve_scan(resolver_t *r, const ast_t *ast) {
+  ast_ref_t ref = r->scanned;
+  if (ref == 0) {
+    for (uint32_t i = 0; i < ast->root_count; ++i)
+      if (ast_kind(ast, ast->roots[i]) == A_FUNDEF)
+        _resolve_define(r, ast, ast->roots[i]);
+    ref = 1;
+  }
+
+  for (; ref < ast->nodes_len; ref += ast_size(ast, ref)) {
+    ast_kind_t kind = ast_kind(ast, ref);
+    if (kind != A_MAIN && kind != A_FUNDEF) continue;
+    sym_t name = ast_name(ast, ref);
+    if (r->functions[name] != ref) r->functions[name] = RESOLVE_DYNAMIC;
+  }
+  r->scanned = ref;
+}
+
+// Checks call `ref` and binds it when its function is known for sure.
+static void _resolve_call(resolver_t *r, ast_t *ast, ast_ref_t ref) {
+  sym_t name = ast_name(ast, ref);
+  uint32_t argc = ast_args(ast, ref).count;
+  builtin_t b = sym_builtin(name);
+
+  if (b != BUILTIN_LAST) {
+    const builtin_info_t *info = &builtin_info[b];
+    if (argc < info->arity || (argc > info->arity && !info->variadic)) {
+      lex_report_err_at(r->lexer, ast_offset(ast, ref),
+                        "'%s' takes %s%u argument%s", info->name,
+                        info->variadic ? "at least " : "", info->arity,
+                        info->arity == 1 ? "" : "s");
+      r->error_count++;
+    }
+    ast->nodes[ref + 3] = AST_CALL_BUILTIN | b;
+    return;
+  }
+
+  ast_ref_t fn = r->check_calls ? r->functions[name] : RESOLVE_DYNAMIC;
+  if (fn == AST_NIL) {
+    lex_report_err_at(r->lexer, ast_offset(ast, ref),
+                      "Undefined function '%s'", intern_name(name));
+    r->error_count++;
+  }
+  bool bind = r->bind_calls && fn != RESOLVE_DYNAMIC && fn < AST_CALL_BUILTIN;
+  ast->nodes[ref + 3] = bind ? fn : AST_NIL;
+}
+
+// Stores the i-th child of `ref` in `*child`. Returns false past the last.
+static bool _resolve_child(const ast_t *ast, ast_ref_t ref, uint32_t i,
+                           ast_ref_t *child) {
+  assert(A_LAST == 7 && "Implementation missing");
+
+  switch (ast_kind(ast, ref)) {
+    case A_MAIN:
+    case A_FUNDEF:
+      *child = ast_body(ast, ref);
+      return i == 0 && *child != AST_NIL;
+
+    case A_SCOPE:
+    case A_FUNCALL: {
+      ast_list_t list = ast_kind(ast, ref) == A_SCOPE
+                            ? ast_statements(ast, ref)
+                            : ast_args(ast, ref);
+      if (i >= list.count) return false;
+      *child = list.items[i];
+      return true;
+    }
+
+    case A_VAR_DECLARE:
+      *child = ast_value(ast, ref);
+      return i == 0;
+
+    default:
+      return false;
+  }
+}
+
+// Drops the declarations from `mark` on, bringing back what they shadowed.
+static void _resolve_pop(resolver_t *r, uint32_t mark) {
+  while (arrlenu(r->decls) > mark) {
+    resolve_decl_t d = arrpop(r->decls);
+    r->visible[d.name] = d.shadows;
+  }
+}
+
+static void _resolve_declare(resolver_t *r, resolve_state_t *s, ast_t *ast,
+                             ast_ref_t ref) {
+  if (!s->in_function) {
+    ast->nodes[ref + 4] = AST_GLOBAL;
+    return;
+  }
+
+  sym_t name = ast_name(ast, ref);
+  uint32_t offset = ast_offset(ast, ref), prev = r->visible[name];
+  if (prev > s->base) {
+    if (prev > s->scope)
+      lex_report_warn_at(r->lexer, offset, "Redeclaration of '%s'",
+                         intern_name(name));
+    else
+      lex_report_warn_at(r->lexer, offset,
+                         "Declaration of '%s' shadows an earlier one",
+                         intern_name(name));
+  }
+
+  uint32_t slot = (uint32_t)arrlenu(r->decls) - s->base;
+  resolve_decl_t d = {name, prev};
+  arrput(r->decls, d);
+  r->visible[name] = (uint32_t)arrlenu(r->decls);
+  if (slot + 1 > s->slots) s->slots = slot + 1;
+  ast->nodes[ref + 4] = slot;
+}
+
+static void _resolve_enter(resolver_t *r, resolve_state_t *s, ast_t *ast,
+                           ast_ref_t ref) {
+  resolve_step_t step = {ref, 0, (uint32_t)arrlenu(r->decls), s->scope,
+                         s->base, s->slots, s->in_function};
+
+  switch (ast_kind(ast, ref)) {
+    case A_MAIN:
+    case A_FUNDEF:
+      s->in_function = true;
+      s->base = s->scope = step.mark;
+      s->slots = 0;
+      break;
+
+    case A_SCOPE:
+      s->scope = step.mark;
+      break;
+
+    case A_FUNCALL:
+      _resolve_call(r, ast, ref);
+      break;
+
+    default:
+      break;
+  }
+
+  arrput(s->steps, step);
+}
+
+static void _resolve_leave(resolver_t *r, resolve_state_t *s, ast_t *ast) {
+  resolve_step_t step = arrpop(s->steps);
+
+  switch (ast_kind(ast, step.ref)) {
+    case A_MAIN:
+    case A_FUNDEF:
+      ast->nodes[step.ref + 4] = s->slots;
+      _resolve_pop(r, step.mark);
+      s->in_function = step.in_function;
+      s->base = step.base;
+      s->slots = step.slots;
+      s->scope = step.scope;
+      break;
+
+    case A_SCOPE:
+      _resolve_pop(r, step.mark);
+      s->scope = step.scope;
+      break;
+
+    case A_VAR_DECLARE:
+      _resolve_declare(r, s, ast, step.ref);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void _resolve_walk(resolver_t *r, ast_t *ast, ast_ref_t root) {
+  resolve_state_t s = {0};
+  _resolve_enter(r, &s, ast, root);
+
+  while (arrlenu(s.steps) > 0) {
+    resolve_step_t *top = &arrlast(s.steps);
+    ast_ref_t child;
+    if (_resolve_child(ast, top->ref, top->next++, &child))
+      _resolve_enter(r, &s, ast, child);
+    else
+      _resolve_leave(r, &s, ast);
+  }
+
+  arrfree(s.steps);
+}
+
+size_t resolve_ast(resolver_t *r, ast_t *ast) {
+  size_t errors = r->error_count;
+  _resolve_grow(r);
+  if (r->check_calls) _resolve_scan(r, ast);
+
+  for (uint32_t i = 0; i < ast->root_count; ++i)
+    _resolve_walk(r, ast, ast->roots[i]);
+
+  return r->error_count - errors;
+}
+
+size_t resolve_function(resolver_t *r, ast_t *ast, ast_ref_t fn) {
+  size_t errors = r->error_count;
+  _resolve_grow(r);
+  if (r->check_calls) _resolve_scan(r, ast);
+
+  _resolve_walk(r, ast, fn);
+
+  return r->error_count - errors;
+}
+
+void resolver_free(resolver_t *r) {
+  arrfree(r->functions);
+  arrfree(r->visible);
+  arrfree(r->decls);
+}
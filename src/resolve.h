@@ -0,0 +1,64 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ast.h"
+#include "lex.h"
+
+// A declaration in scope while resolving.
+typedef struct resolve_decl {
+  sym_t name;
+  uint32_t shadows;  // entry of `visible` it replaced
+} resolve_decl_t;
+
+// Assigns every variable declared in a function a slot in that function's
+// frame, and every function the number of slots it needs, so the interpreter
+// keeps locals in an array rather than by name. Slots of a scope are reused
+// once it ends. Declarations that shadow another are warned about, calls to
+// functions that are defined nowhere or with the wrong number of arguments
+// to a builtin are errors.
+//
+// Calls to builtins are bound to the builtin, and calls to a function
+// defined once, at the top level, to its node, so the interpreter looks
+// neither up by name.
+typedef struct resolver {
+  lex_t *lexer;  // for diagnostics
+
+  // Report calls to undefined functions. Off when the AST is only a part of
+  // the input, and like `bind_calls` when bodies may still be skipped; the
+  // interpreter reports such calls when they are made.
+  bool check_calls;
+
+  // Bind calls to functions. Off when bodies may still define functions
+  // the resolver has not seen, see parser_t.lazy.
+  bool bind_calls;
+
+  // Indexed by symbol id: the function of that name as a call target, see
+  // `_resolve_scan`, and the declaration in scope as an index into `decls` +
+  // 1, 0 for none.
+  ast_ref_t *functions;
+  uint32_t *visible;
+
+  // Declarations in scope, innermost last.
+  resolve_decl_t *decls;
+
+  // Nodes of `ast` scanned for definitions so far.
+  uint32_t scanned;
+
+  size_t error_count;
+} resolver_t;
+
+void resolver_init(resolver_t *r, lex_t *lexer);
+
+// Resolves every node of `ast` and returns the number of errors found.
+// Bodies skipped by a lazy parse are left to resolve_function().
+size_t resolve_ast(resolver_t *r, ast_t *ast);
+
+// Resolves function `fn` of `ast`, once parser_body() has parsed its body.
+size_t resolve_function(resolver_t *r, ast_t *ast, ast_ref_t fn);
+
+void resolver_free(resolver_t *r);
+
+#endif /* ifndef RESOLVE_H */
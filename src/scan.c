@@ -0,0 +1,235 @@
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static inline int _is_space(unsigned char ch) {
+  return ch == ' ' || (unsigned char)(ch - '\t') <= '\r' - '\t';
+}
+
+static const char *_scalar_skip_space(const char *p, const char *end) {
+  while (p < end && _is_space(*p)) p++;
+  return p;
+}
+
+static const char *_scalar_find_byte(const char *p, const char *end, char c) {
+  while (p < end && *p != c) p++;
+  return p;
+}
+
+static const char *_scalar_find_either(const char *p, const char *end, char a,
+                                       char b) {
+  while (p < end && *p != a && *p != b) p++;
+  return p;
+}
+
+static const char *_scalar_find_pair(const char *p, const char *end, char a,
+                                     char b) {
+  for (; p + 1 < end; p++)
+    if (p[0] == a && p[1] == b) return p;
+  return end;
+}
+
+static size_t _scalar_count_byte(const char *p, const char *end, char c) {
+  size_t n = 0;
+  for (; p < end; p++) n += *p == c;
+  return n;
+}
+
+static const scan_ops_t scan_scalar = {
+  "scalar",
+  _scalar_skip_space,
+  _scalar_find_byte,
+  _scalar_find_either,
+  _scalar_find_pair,
+  _scalar_count_byte,
+};
+
+#ifdef SCAN_X86
+
+// SSE2 is part of x86-64, so these need no runtime check there.
+
+__attribute__((target("sse2")))
+static inline unsigned _sse2_space_mask(__m128i x) {
+  __m128i sp = _mm_cmpeq_epi8(x, _mm_set1_epi8(' '));
+  __m128i t = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+  __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t);
+  return _mm_movemask_epi8(_mm_or_si128(sp, ctl));
+}
+
+__attribute__((target("sse2")))
+static const char *_sse2_skip_space(const char *p, const char *end) {
+  for (; p + 16 <= end; p += 16) {
+    unsigned mask = ~_sse2_space_mask(_mm_loadu_si128((const __m128i *)p));
+    mask &= 0xFFFF;
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return _scalar_skip_space(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char *_sse2_find_byte(const char *p, const char *end, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  for (; p + 16 <= end; p += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, needle));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return _scalar_find_byte(p, end, c);
+}
+
+__attribute__((target("sse2")))
+static const char *_sse2_find_either(const char *p, const char *end, char a,
+                                     char b) {
+  __m128i na = _mm_set1_epi8(a), nb = _mm_set1_epi8(b);
+  for (; p + 16 <= end; p += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(x, na), _mm_cmpeq_epi8(x, nb));
+    unsigned mask = _mm_movemask_epi8(eq);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return _scalar_find_either(p, end, a, b);
+}
+
+__attribute__((target("sse2")))
+static const char *_sse2_find_pair(const char *p, const char *end, char a,
+                                   char b) {
+  __m128i na = _mm_set1_epi8(a), nb = _mm_set1_epi8(b);
+  for (; p + 17 <= end; p += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    __m128i y = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(x, na), _mm_cmpeq_epi8(y, nb));
+    unsigned mask = _mm_movemask_epi8(eq);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return _scalar_find_pair(p, end, a, b);
+}
+
+__attribute__((target("sse2")))
+static size_t _sse2_count_byte(const char *p, const char *end, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  size_t n = 0;
+  for (; p + 16 <= end; p += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(x, needle)));
+  }
+  return n + _scalar_count_byte(p, end, c);
+}
+
+static const scan_ops_t scan_sse2 = {
+  "sse2",
+  _sse2_skip_space,
+  _sse2_find_byte,
+  _sse2_find_either,
+  _sse2_find_pair,
+  _sse2_count_byte,
+};
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static const char *_avx2_skip_space(const char *p, const char *end) {
+  __m256i space = _mm256_set1_epi8(' ');
+  __m256i tab = _mm256_set1_epi8('\t');
+  __m256i ctl_span = _mm256_set1_epi8('\r' - '\t');
+  for (; p + 32 <= end; p += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    __m256i t = _mm256_sub_epi8(x, tab);
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(t, ctl_span), t);
+    __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(x, space), ctl);
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(sp);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return _sse2_skip_space(p, end);
+}
+
+AVX2 static const char *_avx2_find_byte(const char *p, const char *end,
+                                        char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  for (; p + 32 <= end; p += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, needle));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return _sse2_find_byte(p, end, c);
+}
+
+AVX2 static const char *_avx2_find_either(const char *p, const char *end,
+                                          char a, char b) {
+  __m256i na = _mm256_set1_epi8(a), nb = _mm256_set1_epi8(b);
+  for (; p + 32 <= end; p += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    __m256i eq =
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, na), _mm256_cmpeq_epi8(x, nb));
+    unsigned mask = _mm256_movemask_epi8(eq);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return _sse2_find_either(p, end, a, b);
+}
+
+AVX2 static const char *_avx2_find_pair(const char *p, const char *end, char a,
+                                        char b) {
+  __m256i na = _mm256_set1_epi8(a), nb = _mm256_set1_epi8(b);
+  for (; p + 33 <= end; p += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    __m256i y = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i eq =
+        _mm256_and_si256(_mm256_cmpeq_epi8(x, na), _mm256_cmpeq_epi8(y, nb));
+    unsigned mask = _mm256_movemask_epi8(eq);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return _sse2_find_pair(p, end, a, b);
+}
+
+AVX2 static size_t _avx2_count_byte(const char *p, const char *end, char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t n = 0;
+  for (; p + 32 <= end; p += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, needle));
+    n += __builtin_popcount(mask);
+  }
+  return n + _sse2_count_byte(p, end, c);
+}
+
+#undef AVX2
+
+static const scan_ops_t scan_avx2 = {
+  "avx2",
+  _avx2_skip_space,
+  _avx2_find_byte,
+  _avx2_find_either,
+  _avx2_find_pair,
+  _avx2_count_byte,
+};
+
+#endif /* SCAN_X86 */
+
+const scan_ops_t *scan = NULL;
+
+int scan_select(const char *name) {
+  const scan_ops_t *best = &scan_scalar;
+
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) best = &scan_sse2;
+  if (__builtin_cpu_supports("avx2")) best = &scan_avx2;
+
+  if (name && strcmp(name, "sse2") == 0) {
+    if (!__builtin_cpu_supports("sse2")) return -1;
+    best = &scan_sse2;
+  } else if (name && strcmp(name, "avx2") == 0) {
+    if (!__builtin_cpu_supports("avx2")) return -1;
+    best = &scan_avx2;
+  }
+#endif
+
+  if (name && strcmp(name, "scalar") == 0) best = &scan_scalar;
+  else if (name && strcmp(name, best->name) != 0) return -1;
+
+  scan = best;
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Byte scanning primitives used by the lexer. Every function looks at the
+// range [p, end) and never reads past `end`; "not found" is reported by
+// returning `end`.
+typedef struct scan_ops {
+  const char *name;
+
+  // First byte that is not isspace().
+  const char *(*skip_space)(const char *p, const char *end);
+
+  // First occurrence of `c`.
+  const char *(*find_byte)(const char *p, const char *end, char c);
+
+  // First occurrence of either `a` or `b`.
+  const char *(*find_either)(const char *p, const char *end, char a, char b);
+
+  // First `a` immediately followed by `b`; returns a pointer to the `a`.
+  const char *(*find_pair)(const char *p, const char *end, char a, char b);
+
+  // Number of occurrences of `c`.
+  size_t (*count_byte)(const char *p, const char *end, char c);
+} scan_ops_t;
+
+// Implementation selected by scan_select(), NULL until then.
+extern const scan_ops_t *scan;
+
+// Selects the scanner by name ("scalar", "sse2", "avx2"), or the fastest
+// one the CPU supports when `name` is NULL. Returns -1 if the requested
+// implementation is unknown or unsupported.
+int scan_select(const char *name);
+
+#endif /* ifndef SCAN_H */